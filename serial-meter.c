@@ -1,7 +1,62 @@
+#define _GNU_SOURCE	/* posix_openpt() and friends. */
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <errno.h>
+#include <math.h>
+#include <complex.h>
+#include <time.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <termios.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <netdb.h>
+#include <dirent.h>
 #include <sys/fcntl.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "tp4000zc.h"
+
+/*
+ * USDT probes, for bpftrace and the like.  Each is a nop until
+ * something attaches to it, and they are left out altogether without
+ * <sys/sdt.h> (systemtap-sdt-dev) or with -DNO_PROBES.
+ */
+#if defined(__has_include) && !defined(NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_PROBES
+#endif
+#endif
+
+#ifndef HAVE_PROBES
+#define DTRACE_PROBE2(provider, name, a, b)		do { } while (0)
+#define DTRACE_PROBE3(provider, name, a, b, c)		do { } while (0)
+#define DTRACE_PROBE4(provider, name, a, b, c, d)	do { } while (0)
+#define DTRACE_PROBE5(provider, name, a, b, c, d, e)	do { } while (0)
+#endif
 
 /*
  * Serial communications protocol for the TekPower TP4000ZC digital
@@ -128,359 +183,9704 @@
  * E8.
 */
 
-int
-read_packet(int fd, unsigned char* buf)
+/*
+ ****************************************************************
+ *
+ * Tracing.
+ *
+ ****************************************************************
+ */
+
+/*
+ * "-T file" records when each stage of handling a frame starts and
+ * how long it takes: reading from the port, framing, decoding and
+ * output in the reader threads, and the writes and renders of the
+ * output threads.  Each thread adds spans to a ring of its own most
+ * recent TRACE_RING without locking.  SIGUSR1, and the end of a
+ * replay, write all the rings to file as Chrome trace event JSON, for
+ * chrome://tracing or ui.perfetto.dev.
+ *
+ * Without -T, each stage costs a test of trace.file.
+ */
+#define TRACE_RING	16384
+
+struct trace_span
 {
-  int x;
-  int n;
-  int byte = 0;
-  int idx;
-  int bytes_read = 0;
+    const char *name;
+    long long start;		/* ns on the monotonic clock. */
+    long long duration;
+    unsigned long n;		/* The frame, or samples or bytes written. */
+};
 
-  for (x = 0; x < 14;x++)
-      buf[x] = 0;
+struct trace_ring
+{
+    char name[32];
+    pid_t tid;
+    struct trace_span *span;
+    _Atomic unsigned long head;	/* Count of spans added. */
+    struct trace_ring *next;
+};
 
-  for (x = 0;x < 15;x++)
-  {
-    n = read(fd, &byte, 1);
+struct trace
+{
+    char *file;			/* NULL if not tracing. */
+    struct trace_ring *_Atomic rings;
+    pthread_mutex_t lock;	/* Only one dump at a time. */
+} trace =
+{
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
 
-    if (n <= 0)
-    {
-        printf("Read EOF\n");
-        exit(0);
-    }
+__thread struct trace_ring *trace_self;
 
-    if (byte == 0)
-    {
-        printf("Meter ON.\n");
-        return -1;
-    }
+/*
+ * Give the calling thread a ring, under name.  Without the memory for
+ * one the thread goes untraced.
+ */
+void
+trace_thread(const char* name)
+{
+    struct trace_ring *r;
 
-    /* This is the byte number */
-    idx = (byte >> 4) & 0xF;
+    if (trace.file == NULL)
+        return;
 
-    if ((idx == 0) || (idx == 0xF))
+    r = calloc(1, sizeof(*r));
+    if (r == NULL)
+        return;
+    r->span = calloc(TRACE_RING, sizeof(struct trace_span));
+    if (r->span == NULL)
     {
-        printf("Read invalid byte 0x%02X\n", byte);
-        return -1;	/* Invalid byte */
+        free(r);
+        return;
     }
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->tid = syscall(SYS_gettid);
 
-    /* IDX is 1-14, but buf is 0 based, so we use idx - 1. */
-    buf[idx - 1] = byte & 0xF;
-    bytes_read++;
-
-    if (idx == 0xE)
-    {
-        /* This is the last byte of a packet. */
+    r->next = atomic_load(&trace.rings);
+    while (!atomic_compare_exchange_weak(&trace.rings, &r->next, r))
+        ;
 
-        /*
-         * We should have read at least 13 bytes - A packet is 14
-         * bytes, but the first byte is not always sent.
-         */
+    trace_self = r;
+}
 
-        if (bytes_read < 13)
-        {
-            printf("Only read %d bytes of packet.\n", bytes_read);
-            return -1;
-        }
-        else
-            return 0;	/* We're done. */
-    }
-  }
+long long
+trace_now(void)
+{
+    struct timespec now;
 
-  /* There were too many bytes read without seeing the last byte */
-  printf("Read too many bytes.\n");
-  return -1;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
 }
 
 /*
- ****************************************************************
- *
- * Decode a single digit.
- *
- ****************************************************************
+ * Start a span.  Returns 0 if not tracing.
  */
-int lcd_segments[12] =
+static inline long long
+trace_begin(void)
 {
-    0x7D,	/* 0 */
-    0x05,
-    0x5B,
-    0x1F,
-    0x27,
-    0x3E,
-    0x7E,
-    0x15,
-    0x7F,
-    0x3F,	/* 9 */
-    0x68,	/* L (out of range) */
-    0x00	/* Blank */
-};
+    if (trace.file == NULL)
+        return 0;
 
-/*
- * This takes two bytes of data from the meter and returns 0-12,
- * representing the digits 0-9, L, and Blank.
- */
-int
-decode_digit(unsigned int byte1, unsigned int byte2)
+    return trace_now();
+}
+
+void
+trace_add(const char* name, long long start, unsigned long n)
 {
-    int value;
-    int n;
+    struct trace_span *s;
+    unsigned long head;
 
-    /*
-     * Concatenate the low four bits of each byte into one eight bit
-     * value and look it up in the LCD segment table.
-     */
-    value = ((byte1 & 0x7) << 4) | byte2;
-    for (n = 0; n < 12;n++)
+    if (trace_self == NULL)
     {
-        if (lcd_segments[n] == value)
-            return n;
+        trace_thread("thread");
+        if (trace_self == NULL)
+            return;
     }
 
-    /* Not table, invalid value. */
-    return -1;
+    head = atomic_load_explicit(&trace_self->head, memory_order_relaxed);
+    s = &trace_self->span[head % TRACE_RING];
+    s->name = name;
+    s->start = start;
+    s->duration = trace_now() - start;
+    s->n = n;
+    atomic_store_explicit(&trace_self->head, head + 1, memory_order_release);
+}
+
+/*
+ * End a span started by trace_begin().
+ */
+static inline void
+trace_end(const char* name, long long start, unsigned long n)
+{
+    if (start)
+        trace_add(name, start, n);
 }
 
+/*
+ * Write out every thread's spans.  A ring's writer carries on while
+ * it is copied, so spans it may have overwritten in the meantime are
+ * left out.
+ */
 int
-print_display_number(unsigned char *buf)
+trace_dump(void)
 {
-    int n;
-    int val;
+    static struct trace_span copy[TRACE_RING];
+    struct trace_ring *r;
+    unsigned long head;
+    unsigned long first;
+    unsigned long n;
+    unsigned long total = 0;
+    int separator = 0;
+    pid_t pid = getpid();
+    FILE *f;
 
-    /*
-     * There are four digits, contained in bytes 2 and 3, 4 and 5, 6
-     * and 7, and 8 and 9.
-     */
-    for (n = 1;n < 8;n += 2)
+    pthread_mutex_lock(&trace.lock);
+
+    f = fopen(trace.file, "w");
+    if (f == NULL)
+    {
+        perror(trace.file);
+        pthread_mutex_unlock(&trace.lock);
+        return -1;
+    }
+
+    fprintf(f, "{\"traceEvents\":[\n");
+    for (r = atomic_load(&trace.rings); r != NULL; r = r->next)
     {
+        head = atomic_load_explicit(&r->head, memory_order_acquire);
+        first = (head > TRACE_RING) ? head - TRACE_RING : 0;
+        for (n = first; n < head; n++)
+            copy[n % TRACE_RING] = r->span[n % TRACE_RING];
+
         /*
-         * The high bit is the decimal point, or the minus sign on the
-         * first digit.
+         * Skip what was overwritten while copying, and the slot the
+         * writer fills before moving the head on to it.
          */
-        if (buf[n] & 0x8)
-        {
-            if (n == 1)
-                printf("-");
-            else
-                printf(".");
-        }
-        val = decode_digit(buf[n], buf[n + 1]);
-        if (val == -1)
-        {
-            printf("Unknown digit %X %X\n", buf[n], buf[n + 1]);
-            return -1;
-        }
-        else
+        atomic_thread_fence(memory_order_acquire);
+        n = atomic_load_explicit(&r->head, memory_order_relaxed);
+        if (n + 1 > first + TRACE_RING)
+            first = n + 1 - TRACE_RING;
+
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            separator ? ",\n" : "", pid, r->tid, r->name);
+        separator = 1;
+
+        for (n = first; n < head; n++)
         {
-            if (val < 10)
-                printf("%d", val);
-            else
-            {
-                if (val == 10)
-                    printf("L");
-                if (val == 11)
-                    printf(" ");
-                if (val > 11)
-                    printf("?");
-            }
+            fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,"
+                "\"tid\":%d,\"ts\":%lld.%03lld,\"dur\":%lld.%03lld,"
+                "\"args\":{\"n\":%lu}}",
+                copy[n % TRACE_RING].name, pid, r->tid,
+                copy[n % TRACE_RING].start / 1000,
+                copy[n % TRACE_RING].start % 1000,
+                copy[n % TRACE_RING].duration / 1000,
+                copy[n % TRACE_RING].duration % 1000,
+                copy[n % TRACE_RING].n);
+            total++;
         }
     }
+    fprintf(f, "\n]}\n");
+
+    if (fclose(f))
+        perror(trace.file);
+    else
+        printf("trace: wrote %lu spans to %s\n", total, trace.file);
+
+    pthread_mutex_unlock(&trace.lock);
 
     return 0;
 }
 
+/*
+ * Dump the trace whenever SIGUSR1 comes in.  It is blocked in every
+ * other thread.
+ */
+void*
+trace_signal_thread(void* arg)
+{
+    sigset_t signals;
+    int sig;
+
+    (void)arg;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+
+    for (;;)
+    {
+        if (sigwait(&signals, &sig) == 0)
+            trace_dump();
+    }
+
+    return NULL;
+}
+
 /*
  ****************************************************************
  *
- * Decode attributes.
+ * Byte sources.
  *
  ****************************************************************
  */
 
 /*
- * The modes the meter can be in.
- *
- * The LCD display has 'hfe' on it, but the meter doesn't do hfe
- * (transistor test), so there's a good chance that one of the
- * unknowns is hfe.
- *
- * It also seems likely that one of the unknowns is degrees
- * fahrenheit, but the meter doesn't support that either.
- *
- * One of the unknowns might be low battery.
+ * Meters are usually plugged straight into a serial port, but they
+ * can also hang off a serial device server such as ser2net.  Those
+ * are reached over TCP, either as a raw byte stream
+ * ("tcp://host:port") or using the telnet COM-PORT-OPTION from RFC
+ * 2217 ("rfc2217://host:port"), which lets us set the remote port to
+ * 2400 baud, 8 data bits, no parity and one stop bit ourselves.
  *
- * E8 is always on, except when measuring temperature.
+ * Either way the bytes end up in the same framer as the ones read
+ * from a local serial port.
  */
-#define ATTR_UNK_11	(1 << 0)	/* 11 - Unknown */
-#define ATTR_AUTO	(1 << 1)
-#define ATTR_DC		(1 << 2)
-#define ATTR_AC		(1 << 3)
-#define ATTR_DIODE	(1 << 4)	/* A1 */
-#define ATTR_KILO	(1 << 5)
-#define ATTR_NANO	(1 << 6)
-#define ATTR_MICRO	(1 << 7)
-#define ATTR_BEEP	(1 << 8)	/* B1 */
-#define ATTR_MEGA	(1 << 9)
-#define ATTR_PERCENT	(1 << 10)
-#define ATTR_MILI	(1 << 11)
-#define ATTR_HOLD	(1 << 12)	/* C1 */
-#define ATTR_REL	(1 << 13)
-#define ATTR_OHMS	(1 << 14)
-#define ATTR_FARAD	(1 << 15)
-#define ATTR_UNK_D1	(1 << 16)	/* D1 - Unknown */
-#define ATTR_HERTZ	(1 << 17)
-#define ATTR_VOLTS	(1 << 18)
-#define ATTR_AMPS	(1 << 19)
-#define ATTR_UNK_E1	(1 << 20)	/* E1 - Unknown */
-#define ATTR_UNK_E2	(1 << 21)	/* E2 - Unknown */
-#define ATTR_DEGC	(1 << 22)
-#define ATTR_UNK_E8	(1 << 23)	/* E8 - Unknown */
+#define SOURCE_TTY	0
+#define SOURCE_TCP	1
+#define SOURCE_RFC2217	2
+#define SOURCE_DERIVED	3	/* Computed from other meters. */
+#define SOURCE_CAPTURE	4	/* Replayed from a capture file. */
 
-char* attribute_table[] =
-{
-    "(unknown 11)",
-    "AUTO",
-    "DC",
-    "AC",
-    "DIODE",
-    "kilo",
-    "nano",
-    "micro",
-    "beep",
-    "mega",
-    "Percent",
-    "mili",
-    "HOLD",
-    "REL",
-    "Ohms",
-    "Farads",
-    "(unknown 0xD1)",
-    "Hertz",
-    "Volts",
-    "Amps",
-    "(unknown E1)",
-    "(unknown E2)",
-    "DegreesC",
-    "(unknown E8)",
-    NULL
-};
+#define METER_BAUD	2400
+
+/* meter_next() return values other than a byte. */
+#define METER_EOF	-1	/* End of file on a local port. */
+#define METER_RESYNC	-2	/* Reconnected, discard any partial packet. */
+#define METER_AGAIN	-3	/* meter_next() has nothing until epoll says. */
+#define METER_GAP	-4	/* The port was silent, see frame_gap. */
+
+#define CONNECT_TIMEOUT	5000	/* ms */
+#define BACKOFF_MIN	250	/* ms */
+#define BACKOFF_MAX	30000	/* ms */
 
 /*
- * Convert the attributes from the string of bytes passed in to a 32
- * bit value.
+ * The meter sends a packet at least every 15 seconds or so (slower
+ * on capacitance), so if a device server goes quiet for longer than
+ * this it has probably gone away without closing the connection.
  */
-unsigned long
-decode_attributes(unsigned char* buf)
+#define TCP_IDLE_TIMEOUT 60	/* seconds */
+
+/*
+ * With "-G ms", bytes that arrive after that long a silence start a
+ * new packet.  A packet is a burst of 13 or 14 bytes about a second
+ * apart, so this frames packets even when the last byte of one is
+ * corrupted, which would otherwise run it into the next; and after
+ * a bad byte the rest of its burst can be skipped rather than being
+ * taken for the start of a packet.  Local ports are also set to wait
+ * for a whole burst (VMIN and VTIME), so that a read wakes us once a
+ * packet rather than once a byte.
+ */
+long long frame_gap;		/* ns, or 0 to frame by the Ex byte alone. */
+
+struct meter
 {
-    unsigned long attributes = 0;
-    int bit;
-    int attr;
-    int byte = 0;
+    int index;			/* In meters[]. */
+    char *name;
+    char *port;			/* As given on the command line. */
+    char *unit;			/* Fixed unit, for derived channels. */
+    int source;			/* SOURCE_xxx */
+    char *host;
+    char *service;
+    int fd;
+    int backoff;		/* Next reconnect delay, in ms. */
 
-    for (bit = 0;bit < 24;bit++)
-    {
-        if (bit < 4)
-            byte = 0;
-        else
-            byte = (bit / 4) + 0x8;
+    /* Telnet stream parser, for RFC 2217. */
+    int telnet_state;
+    int telnet_verb;
+    unsigned char sb[16];
+    int sb_len;
 
-        attr = bit % 4;
+    /* Bytes read from the port but not yet framed. */
+    unsigned char rbuf[256];
+    int rpos;
+    int rlen;
+    long long read_time;	/* When the last read returned, with -G. */
+    int gap;			/* The bytes in rbuf came after a silence, */
+    int skip;			/* and bytes are skipped until the next. */
+    int vmin;			/* Bytes a read of a local port waits for. */
 
-        if (buf[byte] & (1 << attr))
-            attributes |= (1 << bit);
-    }
+    /* The session's coroutines in the event loop, see meter_session(). */
+    int session_line;
+    int frame_line;		/* In frame_packet(), */
+    int frame_x;		/* its loop, */
+    int frame_bytes;
+    unsigned char frame[15];	/* and packet. */
+    struct gaicb resolve;	/* Looking up the device server, */
+    struct addrinfo hints;
+    struct addrinfo *addrs;	/* its addresses, kept while one answers, */
+    struct addrinfo *addr;	/* and the one being tried. */
+    long long wake;		/* Monotonic ns to resume by, or 0. */
+    int timed_out;		/* Resumed because wake passed. */
+    int polled_fd;		/* What epoll is watching for. */
+    int polled_events;
 
-    return attributes;
-}
+    struct derived *derived;	/* How to compute a derived channel, */
+    struct derived **dependents;	/* and those that use this meter. */
+    int ndependents;
+
+    char *topic;		/* MQTT topic for this meter's samples. */
+    char **influx_prefix;	/* Line protocol series, one per unit. */
+    int *influx_prefix_len;
+    pthread_t thread;
+    int remote;			/* Read by another worker process, see -P. */
+
+    /*
+     * Counters, updated by the reader thread and read by the HTTP
+     * server without any locking.
+     */
+    _Atomic unsigned long frames;	/* Packets decoded. */
+    _Atomic unsigned long resyncs;	/* Partial or bad packets dropped. */
+    _Atomic unsigned long invalid_bytes;
+    _Atomic unsigned long decode_failures;
+    _Atomic unsigned long reconnects;
+
+    /* What was last sent to /events?changes, by the reader thread. */
+    char sse_display[16];
+    unsigned long sse_attributes;
+    int sse_seen;
+
+    /* History columns, see history_append(). */
+    int history_fd[3];
+    long history_n;
+
+    /* The attributes of the last packet decoded, by the reader thread. */
+    unsigned long attributes;
+
+    /* Change detection, by the reader thread. */
+    unsigned long detect_mode;	/* Unit, AC/DC, REL and range bits, */
+    int detect_exponent;	/* and exponent the state is for. */
+    long detect_n;
+    double detect_mean;
+    double detect_var;
+    double detect_high;		/* CUSUM of rises, */
+    double detect_low;		/* and of falls, */
+    long long detect_high_start;	/* and when each began. */
+    long long detect_low_start;
+    _Atomic unsigned long spikes;
+    _Atomic unsigned long steps;
+    _Atomic unsigned long step_latency;	/* ns, over all steps. */
+
+    /* Median and percentile filters, by the reader thread. */
+    struct filter_state *filter;
+
+    /* Calibration tables that apply, see calibrate(). */
+    struct calibration **calibrations;
+    int ncalibrations;
+
+    /* The most recent sample, under the last_seq sequence lock. */
+    _Atomic unsigned int last_seq;
+    _Atomic long long last_time;
+    _Atomic double last_value;
+    _Atomic unsigned long last_attributes;
+};
+
+struct meter *meters;
+int nmeters;
+
+/* Telnet commands and options (RFC 854, RFC 2217). */
+#define TELNET_SE	240
+#define TELNET_SB	250
+#define TELNET_WILL	251
+#define TELNET_WONT	252
+#define TELNET_DO	253
+#define TELNET_DONT	254
+#define TELNET_IAC	255
+
+#define TELOPT_BINARY	0
+#define TELOPT_SGA	3
+#define TELOPT_COMPORT	44
+
+#define COMPORT_SET_BAUDRATE	1
+#define COMPORT_SET_DATASIZE	2
+#define COMPORT_SET_PARITY	3
+#define COMPORT_SET_STOPSIZE	4
+#define COMPORT_SERVER_OFFSET	100	/* Added to the command in replies. */
+
+#define COMPORT_PARITY_NONE	1
+#define COMPORT_STOPSIZE_1	1
+
+/* Telnet parser states. */
+#define TS_DATA		0
+#define TS_IAC		1
+#define TS_OPTION	2
+#define TS_SB		3
+#define TS_SB_IAC	4
 
 /*
- * Print out the attributes that are described by the 32 bit value
- * passed in.
+ * Split "host:port" (or "[v6addr]:port") into its two halves, in a
+ * copy that freeing the host frees.
  */
-void
-print_attributes(unsigned long attributes)
+int
+parse_host_port(char* spec, char** host, char** service)
 {
-    int n;
+    char *copy;
+    char *colon;
 
-    for (n = 0;n < 24;n++)
+    copy = strdup(spec);
+    colon = strrchr(copy, ':');
+    if ((colon == NULL) || (colon == copy) || (colon[1] == '\0'))
     {
-        if (attributes & (1 << n))
-            printf("%s ", attribute_table[n]);
+        free(copy);
+        return -1;
     }
-}
+    *colon = '\0';
+    *service = colon + 1;
 
-/*
- ****************************************************************
- *
- * Main loop.
- *
- ****************************************************************
- */
+    if ((copy[0] == '[') && (colon[-1] == ']'))
+    {
+        colon[-1] = '\0';
+        memmove(copy, copy + 1, colon - copy - 1);
+    }
+    *host = copy;
+
+    return 0;
+}
 
 /*
- * Configure the serial port to 2400 baut, 8 data bits, 1 stop bit,
- * and no parity.
+ * Connect to a TCP server without blocking for longer than
+ * CONNECT_TIMEOUT on an address that doesn't answer.  Returns a
+ * blocking socket with Nagle turned off, or -1.
  */
 int
-configure_serial_port(char* dev)
+tcp_connect(char* host, char* service)
 {
-    char string[64];
+    struct addrinfo hints;
+    struct addrinfo *res;
+    struct addrinfo *ai;
+    struct pollfd pfd;
+    struct timeval tv;
+    socklen_t len;
+    int fd = -1;
+    int err;
+    int on = 1;
 
-    sprintf(string, "stty -F %s 2400 -parity", dev);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
 
-    return system(string);
-}
+    err = getaddrinfo(host, service, &hints, &res);
+    if (err)
+    {
+        printf("%s:%s: %s\n", host, service, gai_strerror(err));
+        return -1;
+    }
 
-int
-main(int argc, char **argv)
-{
-  int fd;
-  int n;
-  unsigned char buf[15];
-  unsigned long attributes;
-  char *port;
+    for (ai = res; ai != NULL; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
 
-  if (argc > 1)
-      port = argv[1];
-  else
-      port = "/dev/ttyS0";
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
 
-  if (configure_serial_port(port))
-      printf("Couldn't configure serial port \"%s\"\n", port);
+        err = 0;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0)
+        {
+            if (errno != EINPROGRESS)
+                err = errno;
+            else
+            {
+                pfd.fd = fd;
+                pfd.events = POLLOUT;
+                if (poll(&pfd, 1, CONNECT_TIMEOUT) <= 0)
+                    err = ETIMEDOUT;
+                else
+                {
+                    len = sizeof(err);
+                    getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                }
+            }
+        }
 
-  fd = open(port, O_RDONLY);
+        if (err == 0)
+            break;
 
-  if (fd < 0)
-  {
-      perror(port);
-      exit(0);
-  }
+        close(fd);
+        fd = -1;
+    }
 
-  while (1)
-  {
-      /* Read a packet. */
-      n = read_packet(fd, buf);
+    freeaddrinfo(res);
 
-      /* Ignore errors. */
-      if (n)
-          continue;
+    if (fd < 0)
+        return -1;
 
-#if 0
-      for (n = 0;n < 14;n++)
-          printf("%1X=%02X ", n + 1, buf[n]);
-      printf("\n");
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+    /*
+     * Packets are only 13 or 14 bytes, and RFC 2217 replies are even
+     * smaller, so don't let Nagle hold any of them back.
+     */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+
+    tv.tv_sec = TCP_IDLE_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    return fd;
+}
+
+/*
+ * Append a byte to a telnet command, doubling it if it happens to be
+ * IAC.
+ */
+int
+telnet_put(unsigned char* cmd, int len, unsigned int byte)
+{
+    cmd[len++] = byte;
+    if (byte == TELNET_IAC)
+        cmd[len++] = byte;
+
+    return len;
+}
+
+void
+telnet_send(struct meter* m, unsigned char* cmd, int len)
+{
+    if (write(m->fd, cmd, len) != len)
+        printf("%s: short write to server\n", m->port);
+}
+
+/*
+ * Send a COM-PORT-OPTION subnegotiation with a one or four byte value.
+ */
+void
+rfc2217_set(struct meter* m, int command, unsigned long value, int size)
+{
+    unsigned char cmd[16];
+    int len = 0;
+
+    cmd[len++] = TELNET_IAC;
+    cmd[len++] = TELNET_SB;
+    cmd[len++] = TELOPT_COMPORT;
+    cmd[len++] = command;
+    if (size == 4)
+    {
+        len = telnet_put(cmd, len, (value >> 24) & 0xFF);
+        len = telnet_put(cmd, len, (value >> 16) & 0xFF);
+        len = telnet_put(cmd, len, (value >> 8) & 0xFF);
+    }
+    len = telnet_put(cmd, len, value & 0xFF);
+    cmd[len++] = TELNET_IAC;
+    cmd[len++] = TELNET_SE;
+
+    telnet_send(m, cmd, len);
+}
+
+/*
+ * Ask the device server for a binary connection and set its serial
+ * port up for the meter.
+ */
+void
+rfc2217_negotiate(struct meter* m)
+{
+    unsigned char cmd[] =
+    {
+        TELNET_IAC, TELNET_WILL, TELOPT_BINARY,
+        TELNET_IAC, TELNET_DO, TELOPT_BINARY,
+        TELNET_IAC, TELNET_WILL, TELOPT_SGA,
+        TELNET_IAC, TELNET_DO, TELOPT_SGA,
+        TELNET_IAC, TELNET_WILL, TELOPT_COMPORT
+    };
+
+    telnet_send(m, cmd, sizeof(cmd));
+
+    rfc2217_set(m, COMPORT_SET_BAUDRATE, METER_BAUD, 4);
+    rfc2217_set(m, COMPORT_SET_DATASIZE, 8, 1);
+    rfc2217_set(m, COMPORT_SET_PARITY, COMPORT_PARITY_NONE, 1);
+    rfc2217_set(m, COMPORT_SET_STOPSIZE, COMPORT_STOPSIZE_1, 1);
+}
+
+/*
+ * Handle WILL/WONT/DO/DONT from the server.  We asked for the options
+ * we want up front, so anything else gets refused.
+ */
+void
+telnet_option(struct meter* m, int verb, int option)
+{
+    unsigned char cmd[3];
+    int wanted;
+
+    wanted = (option == TELOPT_BINARY) || (option == TELOPT_SGA) ||
+        (option == TELOPT_COMPORT);
+
+    if ((option == TELOPT_COMPORT) && (verb == TELNET_DONT))
+        printf("%s: server refused COM-PORT-OPTION\n", m->port);
+
+    if (wanted || (verb == TELNET_WONT) || (verb == TELNET_DONT))
+        return;
+
+    cmd[0] = TELNET_IAC;
+    cmd[1] = (verb == TELNET_DO) ? TELNET_WONT : TELNET_DONT;
+    cmd[2] = option;
+    telnet_send(m, cmd, sizeof(cmd));
+}
+
+void
+telnet_subnegotiation(struct meter* m)
+{
+    unsigned char *sb = m->sb;
+    unsigned long baud;
+
+    if ((m->sb_len < 6) || (sb[0] != TELOPT_COMPORT) ||
+        (sb[1] != COMPORT_SERVER_OFFSET + COMPORT_SET_BAUDRATE))
+        return;
+
+    baud = ((unsigned long)sb[2] << 24) | (sb[3] << 16) | (sb[4] << 8) | sb[5];
+    if (baud != METER_BAUD)
+        printf("%s: server set port to %lu baud, wanted %d\n",
+            m->port, baud, METER_BAUD);
+}
+
+/*
+ * Run one byte from the server through the telnet parser.  Returns
+ * the byte if it is data, or -1 if it was part of a telnet command.
+ */
+int
+telnet_input(struct meter* m, int c)
+{
+    switch (m->telnet_state)
+    {
+    case TS_DATA:
+        if (c != TELNET_IAC)
+            return c;
+        m->telnet_state = TS_IAC;
+        return -1;
+
+    case TS_IAC:
+        m->telnet_state = TS_DATA;
+        if (c == TELNET_IAC)
+            return c;	/* Escaped 0xFF data byte. */
+        if ((c >= TELNET_WILL) && (c <= TELNET_DONT))
+        {
+            m->telnet_verb = c;
+            m->telnet_state = TS_OPTION;
+        }
+        else if (c == TELNET_SB)
+        {
+            m->sb_len = 0;
+            m->telnet_state = TS_SB;
+        }
+        return -1;
+
+    case TS_OPTION:
+        telnet_option(m, m->telnet_verb, c);
+        m->telnet_state = TS_DATA;
+        return -1;
+
+    case TS_SB:
+        if (c == TELNET_IAC)
+            m->telnet_state = TS_SB_IAC;
+        else if (m->sb_len < (int)sizeof(m->sb))
+            m->sb[m->sb_len++] = c;
+        return -1;
+
+    case TS_SB_IAC:
+        if (c == TELNET_SE)
+        {
+            telnet_subnegotiation(m);
+            m->telnet_state = TS_DATA;
+        }
+        else
+        {
+            if (m->sb_len < (int)sizeof(m->sb))
+                m->sb[m->sb_len++] = c;
+            m->telnet_state = TS_SB;
+        }
+        return -1;
+    }
+
+    return -1;
+}
+
+/*
+ * Wait before trying a server again, doubling the delay each time
+ * until it starts talking to us.
+ */
+void
+backoff_wait(int* backoff)
+{
+    poll(NULL, 0, *backoff);
+
+    *backoff *= 2;
+    if (*backoff > BACKOFF_MAX)
+        *backoff = BACKOFF_MAX;
+}
+
+/*
+ * (Re)connect to a device server, backing off exponentially while it
+ * is unreachable.  Doesn't return until it has a connection.
+ */
+void
+meter_connect(struct meter* m)
+{
+    for (;;)
+    {
+        m->fd = tcp_connect(m->host, m->service);
+        if (m->fd >= 0)
+            break;
+
+        printf("%s: couldn't connect, retrying in %d ms\n",
+            m->port, m->backoff);
+        backoff_wait(&m->backoff);
+    }
+
+    m->telnet_state = TS_DATA;
+    m->rpos = 0;
+    m->rlen = 0;
+    m->read_time = 0;
+    m->skip = 0;
+
+    if (m->source == SOURCE_RFC2217)
+        rfc2217_negotiate(m);
+}
+
+/*
+ * Configure the serial port to 2400 baut, 8 data bits, 1 stop bit,
+ * and no parity.
+ */
+int
+configure_serial_port(char* dev)
+{
+    char string[64];
+
+    sprintf(string, "stty -F %s 2400 -parity", dev);
+
+    return system(string);
+}
+
+/*
+ * Have reads of a local port return once vmin bytes, a packet, have
+ * come in, or the line has been quiet for the gap (in tenths of a
+ * second, at least one), rather than for every byte.  Packets are 13
+ * or 14 bytes depending on the meter, so frame_packet() sets vmin to
+ * the size of the last good one, or a short packet would wait for the
+ * gap and a long one take two reads.  Ports that don't block, as with
+ * -e, ignore VMIN and VTIME.
+ */
+void
+wait_for_bursts(struct meter* m, int vmin)
+{
+    struct termios t;
+    long long tenths = frame_gap / 100000000;
+
+    if (tcgetattr(m->fd, &t) < 0)
+        return;		/* Not a tty, a file or a FIFO say. */
+
+    t.c_lflag &= ~ICANON;
+    t.c_cc[VMIN] = vmin;
+    t.c_cc[VTIME] = (tenths < 1) ? 1 : (tenths > 255) ? 255 : tenths;
+    if (tcsetattr(m->fd, TCSANOW, &t) == 0)
+        m->vmin = vmin;
+}
+
+/*
+ * Set up a meter from a port named on the command line, which is
+ * either a local serial device or a "tcp://" or "rfc2217://" device
+ * server address, optionally preceded by "name=".  Local ports are
+ * opened straight away, device servers are connected to by the
+ * meter's reader thread.
+ */
+int
+meter_open(struct meter* m, char* port, int index)
+{
+    char *eq;
+    char name[16];
+
+    memset(m, 0, sizeof(*m));
+    m->index = index;
+    m->backoff = BACKOFF_MIN;
+
+    eq = strchr(port, '=');
+    if ((eq != NULL) && (eq != port) && (memchr(port, '/', eq - port) == NULL))
+    {
+        m->name = strndup(port, eq - port);
+        port = eq + 1;
+    }
+    else
+    {
+        sprintf(name, "meter%d", index);
+        m->name = strdup(name);
+    }
+    m->port = port;
+
+    if (strncmp(port, "tcp://", 6) == 0)
+        m->source = SOURCE_TCP;
+    else if (strncmp(port, "rfc2217://", 10) == 0)
+        m->source = SOURCE_RFC2217;
+    else
+        m->source = SOURCE_TTY;
+
+    if (m->source == SOURCE_TTY)
+    {
+        if (configure_serial_port(port))
+            printf("Couldn't configure serial port \"%s\"\n", port);
+
+        m->fd = open(port, O_RDONLY);
+        if (m->fd < 0)
+        {
+            perror(port);
+            return -1;
+        }
+        if (frame_gap)
+            wait_for_bursts(m, 13);
+        return 0;
+    }
+
+    if (parse_host_port(strstr(port, "://") + 3, &m->host, &m->service))
+    {
+        printf("Bad address \"%s\", expected host:port\n", port);
+        return -1;
+    }
+
+    m->fd = -1;
+
+    return 0;
+}
+
+/*
+ * Note when a read returned, and whether the port had been silent for
+ * the gap before it.
+ */
+void
+meter_arrived(struct meter* m)
+{
+    struct timespec now;
+    long long time;
+
+    if (frame_gap == 0)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    time = now.tv_sec * 1000000000LL + now.tv_nsec;
+    if (m->read_time && (time - m->read_time >= frame_gap))
+        m->gap = 1;
+    m->read_time = time;
+}
+
+void meter_close(struct meter* m);
+
+/*
+ * Get the next data byte from a meter.  Returns the byte, METER_EOF
+ * at the end of a local port, METER_RESYNC if a device server
+ * connection was lost, or with -G METER_GAP before the first byte
+ * after a silence.
+ *
+ * With block set the read waits for the port, and a lost connection
+ * is re-established before returning.  Otherwise, for the event loop,
+ * it returns METER_AGAIN if there is nothing to read yet, and a lost
+ * connection is closed, leaving the meter's fd -1 for meter_session()
+ * to reconnect.
+ */
+int
+meter_next(struct meter* m, int block)
+{
+    long long start;
+    int c;
+
+    for (;;)
+    {
+        if (m->rpos >= m->rlen)
+        {
+            start = trace_begin();
+            m->rlen = read(m->fd, m->rbuf, sizeof(m->rbuf));
+            m->rpos = 0;
+            trace_end("read", start, m->frames);
+
+            if ((m->rlen < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+            {
+                m->rlen = 0;
+                if (block)
+                    continue;
+                return METER_AGAIN;
+            }
+
+            if (m->rlen <= 0)
+            {
+                m->rlen = 0;
+                if (m->source == SOURCE_TTY)
+                    return METER_EOF;
+
+                printf("%s: connection lost\n", m->port);
+                m->reconnects++;
+                meter_close(m);
+                if (block)
+                {
+                    backoff_wait(&m->backoff);
+                    meter_connect(m);
+                }
+                return METER_RESYNC;
+            }
+
+            /* The server is talking to us again. */
+            m->backoff = BACKOFF_MIN;
+            meter_arrived(m);
+        }
+
+        if (m->gap)
+        {
+            m->gap = 0;
+            m->skip = 0;
+            return METER_GAP;
+        }
+
+        c = m->rbuf[m->rpos++];
+
+        if (m->source == SOURCE_RFC2217)
+        {
+            c = telnet_input(m, c);
+            if (c < 0)
+                continue;
+        }
+
+        if (m->skip)
+            continue;
+
+        return c;
+    }
+}
+
+/*
+ ****************************************************************
+ *
+ * Read a packet.
+ *
+ ****************************************************************
+ */
+
+/*
+ * Stackless coroutines, after Simon Tatham's: a function keeps the
+ * line it got to in an int, and carries on from there when it is
+ * called again.  Anything that has to last across a CO_YIELD() lives
+ * in the meter rather than in locals, so a port costs a few bytes in
+ * its struct meter rather than a stack.
+ */
+#define CO_BEGIN(line)		switch (line) { case 0:
+#define CO_YIELD(line, value)	do { line = __LINE__; return value; \
+				     case __LINE__:; } while (0)
+#define CO_RETURN(line, value)	do { line = 0; return value; } while (0)
+#define CO_END(line)		} line = 0
+
+#define FRAME_MORE	-3	/* frame_packet() is waiting for bytes. */
+
+/*
+ * Frame the next packet from a meter into m->frame, one nibble per
+ * byte.  Returns 0 if a whole packet was read, -1 if it was bad, or -2
+ * at the end of the port.
+ *
+ * Unless block is set, this is a coroutine for the event loop: it
+ * returns FRAME_MORE whenever the port has no more bytes for now, and
+ * carries on where it left off when called again.
+ */
+int
+frame_packet(struct meter* m, int block)
+{
+    int n;
+    int idx;
+
+    CO_BEGIN(m->frame_line);
+
+    memset(m->frame, 0, sizeof(m->frame));
+    m->frame_bytes = 0;
+
+    for (m->frame_x = 0; m->frame_x < 15; m->frame_x++)
+    {
+        while ((n = meter_next(m, block)) == METER_AGAIN)
+            CO_YIELD(m->frame_line, FRAME_MORE);
+
+        if (n == METER_EOF)
+        {
+            printf("Read EOF\n");
+            CO_RETURN(m->frame_line, -2);
+        }
+
+        if (n == METER_RESYNC)
+            CO_RETURN(m->frame_line, -1);	/* Partial packet. */
+
+        if (n == METER_GAP)
+        {
+            /* A silence ends a packet, so this starts the next. */
+            if (m->frame_bytes == 0)
+            {
+                m->frame_x--;
+                continue;
+            }
+            printf("Only read %d bytes of packet before a gap.\n",
+                m->frame_bytes);
+            CO_RETURN(m->frame_line, -1);
+        }
+
+        if (n == 0)
+        {
+            printf("Meter ON.\n");
+            m->skip = (frame_gap != 0);
+            CO_RETURN(m->frame_line, -1);
+        }
+
+        /* This is the byte number, 1-14. */
+        idx = (n >> 4) & 0xF;
+        if ((idx == 0) || (idx == 0xF))
+        {
+            printf("Read invalid byte 0x%02X\n", n);
+            m->invalid_bytes++;
+            m->skip = (frame_gap != 0);
+            CO_RETURN(m->frame_line, -1);
+        }
+
+        m->frame[idx - 1] = n & 0xF;
+        m->frame_bytes++;
+
+        if (idx == 0xE)
+        {
+            /*
+             * This is the last byte of a packet.  We should have read
+             * at least 13 bytes - a packet is 14 bytes, but the first
+             * byte is not always sent.
+             */
+            if (m->frame_bytes < 13)
+            {
+                printf("Only read %d bytes of packet.\n", m->frame_bytes);
+                CO_RETURN(m->frame_line, -1);
+            }
+
+            DTRACE_PROBE4(serial_meter, frame, m->index, m->name, m->frame,
+                m->frame_bytes);
+            if (m->vmin && (m->vmin != m->frame_bytes))
+                wait_for_bursts(m, m->frame_bytes);
+            CO_RETURN(m->frame_line, 0);
+        }
+    }
+
+    printf("Read too many bytes.\n");
+    m->skip = (frame_gap != 0);
+
+    CO_END(m->frame_line);
+
+    return -1;
+}
+
+/*
+ * Read the next packet from a meter into buf, waiting for it.
+ * Returns as frame_packet() does.
+ */
+int
+read_packet(struct meter* m, unsigned char* buf)
+{
+    int n;
+
+    n = frame_packet(m, 1);
+    memcpy(buf, m->frame, 14);
+
+    return n;
+}
+
+/*
+ ****************************************************************
+ *
+ * Decode a single digit.
+ *
+ ****************************************************************
+ */
+
+/*
+ * The segments lit for 0-9, L (out of range) and blank, starting from
+ * tp4000zc.h's list.  A variant file can replace them.
+ */
+int lcd_segments[12] = { TP4000ZC_SEGMENT_LIST };
+
+/*
+ * lcd_segments[] inverted: the digit for each of the 128 patterns of
+ * seven segments, or -1.  Built by build_tables(), and the same as
+ * tp4000zc_digits until a variant is loaded.
+ */
+int8_t digit_table[128];
+
+/*
+ * This takes two bytes of data from the meter and returns 0-12,
+ * representing the digits 0-9, L, and Blank.
+ */
+int
+decode_digit(unsigned int byte1, unsigned int byte2)
+{
+    return tp4000zc_digit_in(digit_table, byte1, byte2);
+}
+
+/*
+ * The "-F" median and percentile filters, see filter_update().
+ */
+#define FILTER_PERCENTILES	4	/* Most that "-F" takes. */
+
+struct filter
+{
+    int n;			/* Readings in the window, 0 if not filtering. */
+    int npercentiles;
+    double percentiles[FILTER_PERCENTILES];
+    double log_gamma;		/* Of the ratio between bins. */
+    int keys;			/* Bins for each sign, either side of 1. */
+} filter;
+
+/*
+ * A decoded packet.
+ */
+struct sample
+{
+    struct meter *meter;
+    long long time;		/* When the packet ended, ns since the epoch, */
+    long long mono;		/* and on the monotonic clock. */
+    char display[16];		/* The number as shown, e.g. "-04.71". */
+    int overload;		/* The display shows L rather than a number. */
+    long count;			/* The digits shown, ignoring the point. */
+    int decimals;		/* Digits after the decimal point. */
+    double value;		/* In base units, e.g. 4710 for 4.71 kOhms. */
+    unsigned long attributes;
+
+    /* Set if this reports a change in the readings, see detect_update(). */
+    int event;
+    double baseline;		/* Where the readings had been. */
+    double score;		/* How far off this one is, in deviations. */
+    long long latency;		/* ns since the change began. */
+
+    /* Filtered readings, see filter_update(), if filtered is set. */
+    int filtered;		/* Readings they are over. */
+    double median;
+    double percentiles[FILTER_PERCENTILES];
+};
+
+#define EVENT_SPIKE	1
+#define EVENT_STEP_UP	2
+#define EVENT_STEP_DOWN	3
+
+char *event_names[] = { "", "spike", "step_up", "step_down" };
+
+/*
+ * Decode the four digits on the display into the sample's display
+ * string and count.
+ */
+int
+decode_display_number(unsigned char *buf, struct sample* s)
+{
+    struct tp4000zc_reading r = tp4000zc_decode_in(buf, digit_table);
+
+    if (!r.valid)
+    {
+        printf("Unknown digit %X %X\n", buf[r.bad], buf[r.bad + 1]);
+        return -1;
+    }
+
+    memcpy(s->display, r.display, sizeof(r.display));
+    s->count = r.count;
+    s->decimals = r.decimals;
+    s->overload = r.overload;
+
+    return 0;
+}
+
+/*
+ ****************************************************************
+ *
+ * Decode attributes.
+ *
+ ****************************************************************
+ */
+
+/*
+ * The modes the meter can be in.
+ *
+ * The LCD display has 'hfe' on it, but the meter doesn't do hfe
+ * (transistor test), so there's a good chance that one of the
+ * unknowns is hfe.
+ *
+ * It also seems likely that one of the unknowns is degrees
+ * fahrenheit, but the meter doesn't support that either.
+ *
+ * One of the unknowns might be low battery.
+ *
+ * E8 is always on, except when measuring temperature.
+ */
+#define ATTR_UNK_11	(1 << 0)	/* 11 - Unknown */
+#define ATTR_AUTO	(1 << 1)
+#define ATTR_DC		(1 << 2)
+#define ATTR_AC		(1 << 3)
+#define ATTR_DIODE	(1 << 4)	/* A1 */
+#define ATTR_KILO	(1 << 5)
+#define ATTR_NANO	(1 << 6)
+#define ATTR_MICRO	(1 << 7)
+#define ATTR_BEEP	(1 << 8)	/* B1 */
+#define ATTR_MEGA	(1 << 9)
+#define ATTR_PERCENT	(1 << 10)
+#define ATTR_MILI	(1 << 11)
+#define ATTR_HOLD	(1 << 12)	/* C1 */
+#define ATTR_REL	(1 << 13)
+#define ATTR_OHMS	(1 << 14)
+#define ATTR_FARAD	(1 << 15)
+#define ATTR_UNK_D1	(1 << 16)	/* D1 - Unknown */
+#define ATTR_HERTZ	(1 << 17)
+#define ATTR_VOLTS	(1 << 18)
+#define ATTR_AMPS	(1 << 19)
+#define ATTR_UNK_E1	(1 << 20)	/* E1 - Unknown */
+#define ATTR_UNK_E2	(1 << 21)	/* E2 - Unknown */
+#define ATTR_DEGC	(1 << 22)
+#define ATTR_UNK_E8	(1 << 23)	/* E8 - Unknown */
+
+char* attribute_table[] =
+{
+    "(unknown 11)",
+    "AUTO",
+    "DC",
+    "AC",
+    "DIODE",
+    "kilo",
+    "nano",
+    "micro",
+    "beep",
+    "mega",
+    "Percent",
+    "mili",
+    "HOLD",
+    "REL",
+    "Ohms",
+    "Farads",
+    "(unknown 0xD1)",
+    "Hertz",
+    "Volts",
+    "Amps",
+    "(unknown E1)",
+    "(unknown E2)",
+    "DegreesC",
+    "(unknown E8)",
+    NULL
+};
+
+/*
+ * attribute_table[] compiled for printing: the names of the bits set
+ * in each of the six attribute nibbles, for each value of the nibble.
+ * Built by build_tables().
+ */
+char *attribute_names[6][16];
+
+/*
+ * Convert the attributes from the string of bytes passed in to a 32
+ * bit value.
+ */
+unsigned long
+decode_attributes(unsigned char* buf)
+{
+    return tp4000zc_attributes(buf);
+}
+
+/*
+ * Print out the attributes that are described by the 32 bit value
+ * passed in.
+ */
+void
+print_attributes(unsigned long attributes)
+{
+    int n;
+
+    for (n = 0;n < 6;n++)
+        fputs(attribute_names[n][(attributes >> (n * 4)) & 0xF], stdout);
+}
+
+/*
+ ****************************************************************
+ *
+ * Meter variants.
+ *
+ ****************************************************************
+ */
+
+/*
+ * Firmware revisions differ a little in their segment patterns and in
+ * what the unknown attribute bits mean, so "-f file" can change
+ * lcd_segments[] and attribute_table[] at startup:
+ *
+ *   # Comments and blank lines are ignored.
+ *   segment 7 0x17
+ *   segment L 0x68
+ *   attribute E8 RS232
+ *   attribute D1 hFE
+ *
+ * A segment line gives the pattern for a digit (0-9, L or blank), and
+ * an attribute line names a bit by its byte and bit value, as in the
+ * protocol description (1x or Ax to Ex, then 1, 2, 4 or 8).
+ *
+ * Either way, the tables are then compiled by build_tables() into
+ * digit_table[] and attribute_names[], which is what decoding and
+ * printing use, so a variant decodes as fast as the built in meter.
+ */
+
+/*
+ * Build the lookup tables from lcd_segments[] and attribute_table[].
+ * Returns -1 if two digits have the same pattern.
+ */
+int
+build_tables(void)
+{
+    char names[256];
+    int len;
+    int bit;
+    int n;
+    int v;
+
+    memset(digit_table, -1, sizeof(digit_table));
+    for (n = 0; n < 12; n++)
+    {
+        if (digit_table[lcd_segments[n]] != -1)
+        {
+            printf("Digits %d and %d both have segments 0x%02X\n",
+                digit_table[lcd_segments[n]], n, lcd_segments[n]);
+            return -1;
+        }
+        digit_table[lcd_segments[n]] = n;
+    }
+
+    for (n = 0; n < 6; n++)
+    {
+        for (v = 0; v < 16; v++)
+        {
+            len = 0;
+            names[0] = '\0';
+            for (bit = 0; bit < 4; bit++)
+            {
+                if (v & (1 << bit))
+                    len += snprintf(names + len, sizeof(names) - len, "%s ",
+                        attribute_table[n * 4 + bit]);
+            }
+
+            free(attribute_names[n][v]);
+            attribute_names[n][v] = strdup(names);
+        }
+    }
+
+    return 0;
+}
+
+int
+load_variant(char* file)
+{
+    char line[256];
+    char what[16];
+    char key[16];
+    char value[128];
+    char *hex = "0123456789ABCDEF";
+    char *p;
+    FILE *f;
+    int lineno = 0;
+    int byte;
+    int bit;
+    int n;
+
+    f = fopen(file, "r");
+    if (f == NULL)
+    {
+        perror(file);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f))
+    {
+        lineno++;
+        p = line + strspn(line, " \t");
+        if ((*p == '#') || (*p == '\n') || (*p == '\0'))
+            continue;
+
+        value[0] = '\0';
+        if (sscanf(p, "%15s %15s %127[^\n]", what, key, value) < 3)
+            goto bad;
+
+        if (strcmp(what, "segment") == 0)
+        {
+            if (strcasecmp(key, "L") == 0)
+                n = 10;
+            else if (strcasecmp(key, "blank") == 0)
+                n = 11;
+            else if ((strlen(key) == 1) && (key[0] >= '0') && (key[0] <= '9'))
+                n = key[0] - '0';
+            else
+                goto bad;
+
+            lcd_segments[n] = strtol(value, &p, 0);
+            if ((*p != '\0') || (lcd_segments[n] < 0) ||
+                (lcd_segments[n] > 0x7F))
+                goto bad;
+        }
+        else if (strcmp(what, "attribute") == 0)
+        {
+            /* "1x" is bits 0-3, "Ax" to "Ex" are bits 4-23. */
+            p = strchr(hex, toupper(key[0]));
+            if ((strlen(key) != 2) || (p == NULL))
+                goto bad;
+            byte = p - hex;
+            if ((byte != 1) && ((byte < 0xA) || (byte > 0xE)))
+                goto bad;
+
+            switch (key[1])
+            {
+            case '1': bit = 0; break;
+            case '2': bit = 1; break;
+            case '4': bit = 2; break;
+            case '8': bit = 3; break;
+            default: goto bad;
+            }
+
+            n = ((byte == 1) ? 0 : (byte - 0x9) * 4) + bit;
+            attribute_table[n] = strdup(value);
+        }
+        else
+            goto bad;
+    }
+
+    fclose(f);
+    return build_tables();
+
+bad:
+    printf("%s:%d: can't make sense of \"%.*s\"\n", file, lineno,
+        (int)strcspn(line, "\n"), line);
+    fclose(f);
+    return -1;
+}
+
+/*
+ * The units the meter can show, in order of precedence.  Index 0 is
+ * used when none of them are lit.
+ */
+struct unit
+{
+    unsigned long attribute;
+    char *name;
+} unit_table[] =
+{
+    { 0,		"" },
+    { ATTR_VOLTS,	"V" },
+    { ATTR_AMPS,	"A" },
+    { ATTR_OHMS,	"Ohm" },
+    { ATTR_FARAD,	"F" },
+    { ATTR_HERTZ,	"Hz" },
+    { ATTR_DEGC,	"degC" },
+    { ATTR_PERCENT,	"%" }
+};
+
+#define NUNITS	(int)(sizeof(unit_table) / sizeof(unit_table[0]))
+
+int
+attribute_unit_index(unsigned long attributes)
+{
+    int n;
+
+    for (n = 1; n < NUNITS; n++)
+    {
+        if (attributes & unit_table[n].attribute)
+            return n;
+    }
+
+    return 0;
+}
+
+/*
+ * The unit shown on the display.
+ */
+char*
+attribute_unit(unsigned long attributes)
+{
+    return unit_table[attribute_unit_index(attributes)].name;
+}
+
+/*
+ * The power of ten of the SI prefix shown on the display.
+ */
+int
+attribute_exponent(unsigned long attributes)
+{
+    if (attributes & ATTR_NANO)
+        return -9;
+    if (attributes & ATTR_MICRO)
+        return -6;
+    if (attributes & ATTR_MILI)
+        return -3;
+    if (attributes & ATTR_KILO)
+        return 3;
+    if (attributes & ATTR_MEGA)
+        return 6;
+
+    return 0;
+}
+
+/*
+ * The power of ten that turns a sample's count into base units.
+ */
+int
+sample_exponent(struct sample* s)
+{
+    return attribute_exponent(s->attributes) - s->decimals;
+}
+
+/*
+ * Work out the value of a sample in base units from its count,
+ * decimal point and prefix.
+ */
+double
+sample_value(struct sample* s)
+{
+    static const double powers[] =
+    {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12,
+        1e13, 1e14, 1e15, 1e16, 1e17, 1e18
+    };
+    int exp;
+
+    if (s->overload)
+        return NAN;
+
+    exp = sample_exponent(s);
+
+    /* Divide rather than multiply so that 471e-2 comes out as 4.71. */
+    if (exp >= 0)
+        return s->count * powers[exp];
+    else
+        return s->count / powers[-exp];
+}
+
+void filter_update(struct sample* s);
+void calibrate(struct sample* s);
+
+/*
+ * Decode a packet from a meter into a sample.
+ */
+int
+meter_decode(struct meter* m, unsigned char* buf, long long time,
+    long long mono, struct sample* sample)
+{
+    int n;
+
+#if 0
+    for (n = 0;n < 14;n++)
+        printf("%1X=%02X ", n + 1, buf[n]);
+    printf("\n");
 #endif
 
-      /* Print the number. */
-      n = print_display_number(buf);
-      if (n != 0)
-          continue;
-      /* If the nunber was valid then print the attributes. */
-      printf(" ");
-      attributes = decode_attributes(buf);
-      print_attributes(attributes);
-      printf("\n");
+    /* Decode the number. */
+    n = decode_display_number(buf, sample);
+    if (n != 0)
+    {
+        DTRACE_PROBE4(serial_meter, decode_failure, m->index, m->name, buf,
+            time);
+        m->decode_failures++;
+        return -1;
+    }
+
+    /* If the nunber was valid then decode the attributes. */
+    sample->meter = m;
+    sample->time = time;
+    sample->mono = mono;
+    sample->attributes = decode_attributes(buf);
+    sample->value = sample_value(sample);
+    sample->event = 0;
+    sample->filtered = 0;
+
+    if (m->ncalibrations)
+        calibrate(sample);
+
+    if (sample->attributes != m->attributes)
+    {
+        DTRACE_PROBE5(serial_meter, attributes, m->index, m->name,
+            m->attributes, sample->attributes, time);
+        m->attributes = sample->attributes;
+    }
+
+    if (filter.n)
+        filter_update(sample);
+
+    return 0;
+}
+
+/*
+ * The unit a meter's samples are in.
+ */
+char*
+meter_unit(struct meter* m, unsigned long attributes)
+{
+    if (m->unit)
+        return m->unit;
+
+    return attribute_unit(attributes);
+}
+
+/*
+ * Set a computed value, keeping about ten significant digits in the
+ * count so that outputs which use it are as exact as the value.
+ */
+void
+sample_set_value(struct sample* s, double value)
+{
+    int decimals;
+
+    s->value = value;
+    s->attributes = 0;
+
+    if (!isfinite(value))
+    {
+        s->overload = 1;
+        s->count = 0;
+        s->decimals = 0;
+        strcpy(s->display, "L");
+        return;
+    }
+
+    decimals = 0;
+    if (value != 0)
+        decimals = 9 - (int)floor(log10(fabs(value)));
+    if (decimals < -6)
+        decimals = -6;
+    if (decimals > 15)
+        decimals = 15;
+
+    s->overload = 0;
+    s->count = llround(value * pow(10, decimals));
+    while ((decimals > 0) && (s->count % 10 == 0))
+    {
+        s->count /= 10;
+        decimals--;
+    }
+    s->decimals = decimals;
+
+    snprintf(s->display, sizeof(s->display), "%.6g", value);
+}
+
+/*
+ * Record a meter's latest sample.  Only the meter's reader thread
+ * calls this, so the sequence lock needs no mutex.
+ */
+void
+meter_store_latest(struct meter* m, struct sample* s)
+{
+    unsigned int seq;
+
+    seq = atomic_load_explicit(&m->last_seq, memory_order_relaxed);
+    atomic_store_explicit(&m->last_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    atomic_store_explicit(&m->last_time, s->time, memory_order_relaxed);
+    atomic_store_explicit(&m->last_value, s->value, memory_order_relaxed);
+    atomic_store_explicit(&m->last_attributes, s->attributes,
+        memory_order_relaxed);
+
+    atomic_store_explicit(&m->last_seq, seq + 2, memory_order_release);
+}
+
+/*
+ * Read a meter's latest sample.  Returns -1 if it hasn't had one yet.
+ */
+int
+meter_load_latest(struct meter* m, long long* time, double* value,
+    unsigned long* attributes)
+{
+    unsigned int seq;
+
+    do
+    {
+        seq = atomic_load_explicit(&m->last_seq, memory_order_acquire);
+
+        *time = atomic_load_explicit(&m->last_time, memory_order_relaxed);
+        *value = atomic_load_explicit(&m->last_value, memory_order_relaxed);
+        *attributes = atomic_load_explicit(&m->last_attributes,
+            memory_order_relaxed);
+
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) ||
+        (seq != atomic_load_explicit(&m->last_seq, memory_order_relaxed)));
+
+    return seq ? 0 : -1;
+}
+
+/*
+ * Format a sample as a JSON object, including the meter's name if
+ * one is given.
+ */
+#define SAMPLE_JSON	512
+
+int
+sample_json(char* buf, struct sample* s, char* name)
+{
+    char value[32];
+    int len = 0;
+    int n;
+
+    if (isnan(s->value))
+        strcpy(value, "null");
+    else
+        sprintf(value, "%.10g", s->value);
+
+    buf[len++] = '{';
+    if (name)
+    {
+        len += sprintf(buf + len, "\"meter\":\"");
+        for (; *name && (len < SAMPLE_JSON / 2); name++)
+        {
+            if ((*name == '"') || (*name == '\\'))
+                buf[len++] = '\\';
+            buf[len++] = *name;
+        }
+        len += sprintf(buf + len, "\",");
+    }
+
+    len += sprintf(buf + len,
+        "\"time\":%lld.%03lld,\"value\":%s,\"unit\":\"%s\","
+        "\"display\":\"%s\",\"attributes\":%lu",
+        s->time / 1000000000, (s->time / 1000000) % 1000, value,
+        meter_unit(s->meter, s->attributes), s->display, s->attributes);
+
+    if (s->event)
+        len += sprintf(buf + len,
+            ",\"event\":\"%s\",\"from\":%.10g,\"score\":%.1f,"
+            "\"latency\":%.3f", event_names[s->event], s->baseline,
+            s->score, s->latency / 1e9);
+
+    if (s->filtered)
+    {
+        len += sprintf(buf + len, ",\"median\":%.10g", s->median);
+        for (n = 0; n < filter.npercentiles; n++)
+            len += sprintf(buf + len, ",\"p%g\":%.10g", filter.percentiles[n],
+                s->percentiles[n]);
+    }
+
+    buf[len++] = '}';
+    buf[len] = '\0';
+
+    return len;
+}
+
+/*
+ ****************************************************************
+ *
+ * Change detection.
+ *
+ ****************************************************************
+ */
+
+/*
+ * "-D z[:h]" watches each meter for readings that jump or drift away
+ * from where they have been, in constant time per sample.
+ *
+ * An exponentially weighted mean and variance follow each meter's
+ * readings.  A reading more than z standard deviations from the mean
+ * is a spike, and is left out of the mean.  Two one-sided CUSUMs add
+ * up how far readings keep landing above or below the mean, less
+ * DETECT_SLACK deviations each, and report a step up or down once one
+ * passes h (DETECT_CUSUM by default).  No reading adds more than h/2,
+ * so a lone spike is never a step, and a large step is reported as a
+ * spike on its first reading and a step on its third.  The detection
+ * latency is the time since the CUSUM started to build up.
+ *
+ * The state starts again after a step and whenever the unit, AC/DC,
+ * REL or range changes, and nothing is reported for the first
+ * DETECT_WARMUP readings after that.  The deviation is never taken to
+ * be less than one count of the display, so a steady reading
+ * flickering in its last digit doesn't set anything off.
+ *
+ * Events go to the same outputs as samples, see emit_event().
+ */
+#define DETECT_CUSUM	8
+#define DETECT_SLACK	0.5
+#define DETECT_ALPHA	0.01
+#define DETECT_WARMUP	20
+
+#define DETECT_MODE	(ATTR_DC | ATTR_AC | ATTR_DIODE | ATTR_REL | \
+    ATTR_PERCENT | ATTR_OHMS | ATTR_FARAD | ATTR_HERTZ | ATTR_VOLTS | \
+    ATTR_AMPS | ATTR_DEGC)
+
+struct detect
+{
+    double z;			/* 0 if not detecting. */
+    double h;
+};
+
+/*
+ * Feed a sample to its meter's detectors.  Returns 1 and fills in
+ * event if it shows a change.
+ */
+int
+detect_update(struct sample* s, struct detect* d, struct sample* event)
+{
+    struct meter *m = s->meter;
+    unsigned long mode = s->attributes & DETECT_MODE;
+    int exp = sample_exponent(s);
+    long long start = s->time;
+    double quantum;
+    double building;
+    double alpha;
+    double diff;
+    double z;
+    double dz;
+    int type = 0;
+
+    if (s->overload || isnan(s->value) || (s->attributes & ATTR_HOLD))
+        return 0;
+
+    /*
+     * Derived channels move their decimal point with the value, so
+     * only a change of mode counts for them.
+     */
+    if ((m->detect_n == 0) || (mode != m->detect_mode) ||
+        ((exp != m->detect_exponent) && (m->source != SOURCE_DERIVED)))
+    {
+        m->detect_mode = mode;
+        m->detect_exponent = exp;
+        m->detect_n = 1;
+        m->detect_mean = s->value;
+        m->detect_var = 0;
+        m->detect_high = 0;
+        m->detect_low = 0;
+        return 0;
+    }
+
+    quantum = pow(10, exp);
+    diff = s->value - m->detect_mean;
+    z = diff / sqrt(m->detect_var + quantum * quantum);
+    m->detect_n++;
+
+    /* Whether the readings were already heading this way. */
+    building = (z > 0) ? m->detect_high : m->detect_low;
+
+    dz = fmax(fmin(z, d->h / 2), -d->h / 2);
+    if (m->detect_high == 0)
+        m->detect_high_start = s->time;
+    if (m->detect_low == 0)
+        m->detect_low_start = s->time;
+    m->detect_high = fmax(0, m->detect_high + dz - DETECT_SLACK);
+    m->detect_low = fmax(0, m->detect_low - dz - DETECT_SLACK);
+
+    if (m->detect_n <= DETECT_WARMUP)
+    {
+        m->detect_high = 0;
+        m->detect_low = 0;
+    }
+    else if (m->detect_high > d->h)
+    {
+        type = EVENT_STEP_UP;
+        start = m->detect_high_start;
+    }
+    else if (m->detect_low > d->h)
+    {
+        type = EVENT_STEP_DOWN;
+        start = m->detect_low_start;
+    }
+    else if ((fabs(z) > d->z) && (building == 0))
+        type = EVENT_SPIKE;
+
+    if (type)
+    {
+        *event = *s;
+        event->event = type;
+        event->baseline = m->detect_mean;
+        event->score = z;
+        event->latency = s->time - start;
+    }
+
+    if ((type == EVENT_STEP_UP) || (type == EVENT_STEP_DOWN))
+    {
+        m->steps++;
+        m->step_latency += s->time - start;
+
+        /* Learn the new level as if starting afresh. */
+        m->detect_n = 0;
+    }
+    else if (type == EVENT_SPIKE)
+        m->spikes++;
+    else if ((fabs(z) <= d->z) || (m->detect_n <= DETECT_WARMUP))
+    {
+        /* Average the first readings evenly, to settle quickly. */
+        alpha = 1.0 / m->detect_n;
+        if (alpha < DETECT_ALPHA)
+            alpha = DETECT_ALPHA;
+
+        m->detect_mean += alpha * diff;
+        m->detect_var = (1 - alpha) * (m->detect_var + alpha * diff * diff);
+    }
+
+    return type != 0;
+}
+
+/*
+ ****************************************************************
+ *
+ * Filters.
+ *
+ ****************************************************************
+ */
+
+/*
+ * "-F n[:p,...]" adds the running median of each meter's last n
+ * readings to its samples, and with a list of percentiles (up to
+ * FILTER_PERCENTILES, e.g. "-F 50:5,95"), a band of those percentiles
+ * over the same readings.  Both are updated as each packet is decoded,
+ * in O(log n) time, and go out with the raw value.
+ *
+ * The median is exact.  The window is a ring of readings, each also in
+ * one of two heaps indexed by its place in the ring: the lower half in
+ * a max-heap and the upper half in a min-heap.  A new reading replaces
+ * the oldest in place, is sifted within its heap, and the tops of the
+ * heaps are swapped if it crossed over.
+ *
+ * The percentiles come from a sketch of the same readings, a count of
+ * them in logarithmic bins that keep them to within FILTER_ALPHA of
+ * their value (as in DDSketch).  That is finer than half a count of
+ * the display, so rounding to its four digits gives them exactly, but
+ * calibrated readings have more digits than that and are left as they
+ * come out of the sketch.  Counts are added and taken away as readings
+ * come and go, in a Fenwick tree so that finding the bin of a rank is
+ * a binary search.  Only the span of bins the meter's readings have
+ * reached is kept, growing as needed.
+ * Sketches with the same bins can be merged by adding their counts.
+ *
+ * The window starts again whenever the unit, AC/DC or REL changes.
+ * Readings showing L are left out.
+ */
+#define FILTER_ALPHA	0.00002	/* Relative accuracy of the percentiles. */
+#define FILTER_RANGE	1e12	/* Smallest and largest magnitudes binned. */
+
+struct filter_heap
+{
+    int *slots;			/* Places in the ring. */
+    int n;
+    int sign;			/* 1 for a max-heap, -1 for a min-heap. */
+};
+
+/*
+ * A meter's window, used by its reader thread only.
+ */
+struct filter_state
+{
+    unsigned long mode;
+    double *values;		/* The ring of readings. */
+    int count;
+    int next;			/* The oldest, once the ring is full. */
+    struct filter_heap heaps[2];	/* Lower half, upper half. */
+    unsigned char *heap;	/* Which heap each reading is in, */
+    int *pos;			/* and where. */
+    int low;			/* The first of the sketch's bins kept, */
+    int size;			/* and how many. */
+    int *counts;
+    int *tree;			/* Fenwick tree of the counts. */
+};
+
+/*
+ * The sketch's bin for a value: negative values from the largest
+ * down, then zero, then positive values from the smallest up.
+ */
+int
+filter_bin(double v)
+{
+    int key;
+
+    if (fabs(v) < 1 / FILTER_RANGE)
+        return filter.keys * 2 + 1;
+
+    key = ceil(log(fabs(v)) / filter.log_gamma);
+    if (key < -filter.keys)
+        key = -filter.keys;
+    if (key > filter.keys)
+        key = filter.keys;
+
+    if (v < 0)
+        return filter.keys - key;
+
+    return filter.keys * 3 + 2 + key;
+}
+
+/*
+ * The value a bin stands for, within FILTER_ALPHA of any in it.
+ */
+double
+filter_bin_value(int bin)
+{
+    double gamma = exp(filter.log_gamma);
+    int key;
+
+    if (bin == filter.keys * 2 + 1)
+        return 0;
+
+    if (bin <= filter.keys * 2)
+    {
+        key = filter.keys - bin;
+        return -2 * pow(gamma, key) / (gamma + 1);
+    }
+
+    key = bin - filter.keys * 3 - 2;
+    return 2 * pow(gamma, key) / (gamma + 1);
+}
+
+/*
+ * Keep at least twice as many bins, including bin.
+ */
+void
+filter_grow(struct filter_state* f, int bin)
+{
+    int *counts;
+    int size;
+    int low;
+    int i;
+
+    if (f->size == 0)
+    {
+        size = 64;
+        low = bin - size / 2;
+    }
+    else
+    {
+        size = f->size * 2;
+        while ((bin < f->low + f->size - size) || (bin >= f->low + size))
+            size *= 2;
+        low = (bin < f->low) ? f->low + f->size - size : f->low;
+    }
+
+    counts = calloc(size, sizeof(int));
+    if (f->size)
+        memcpy(counts + f->low - low, f->counts, f->size * sizeof(int));
+    free(f->counts);
+    f->counts = counts;
+    f->low = low;
+    f->size = size;
+
+    /* Build the tree from the counts. */
+    free(f->tree);
+    f->tree = calloc(size + 1, sizeof(int));
+    for (i = 1; i <= size; i++)
+    {
+        f->tree[i] += counts[i - 1];
+        if (i + (i & -i) <= size)
+            f->tree[i + (i & -i)] += f->tree[i];
+    }
+}
+
+void
+filter_count(struct filter_state* f, double v, int delta)
+{
+    int bin = filter_bin(v);
+    int i;
+
+    if ((bin < f->low) || (bin >= f->low + f->size))
+        filter_grow(f, bin);
+
+    f->counts[bin - f->low] += delta;
+    for (i = bin - f->low + 1; i <= f->size; i += i & -i)
+        f->tree[i] += delta;
+}
+
+/*
+ * The bin holding the reading of a rank, counting from 0.
+ */
+int
+filter_rank(struct filter_state* f, int rank)
+{
+    int step;
+    int i = 0;
+
+    /* The size is a power of two. */
+    for (step = f->size; step; step /= 2)
+    {
+        if ((i + step <= f->size) && (f->tree[i + step] <= rank))
+        {
+            i += step;
+            rank -= f->tree[i];
+        }
+    }
+
+    return f->low + i;
+}
+
+/*
+ * Whether ring slot a belongs above slot b in a heap.
+ */
+int
+filter_above(struct filter_state* f, struct filter_heap* h, int a, int b)
+{
+    return h->sign * (f->values[a] - f->values[b]) > 0;
+}
+
+void
+filter_place(struct filter_state* f, struct filter_heap* h, int pos, int slot)
+{
+    h->slots[pos] = slot;
+    f->heap[slot] = h - f->heaps;
+    f->pos[slot] = pos;
+}
+
+void
+filter_sift(struct filter_state* f, struct filter_heap* h, int pos)
+{
+    int slot = h->slots[pos];
+    int child;
+
+    while ((pos > 0) && filter_above(f, h, slot, h->slots[(pos - 1) / 2]))
+    {
+        filter_place(f, h, pos, h->slots[(pos - 1) / 2]);
+        pos = (pos - 1) / 2;
+    }
+
+    for (;;)
+    {
+        child = pos * 2 + 1;
+        if (child >= h->n)
+            break;
+        if ((child + 1 < h->n) &&
+            filter_above(f, h, h->slots[child + 1], h->slots[child]))
+            child++;
+        if (!filter_above(f, h, h->slots[child], slot))
+            break;
+        filter_place(f, h, pos, h->slots[child]);
+        pos = child;
+    }
+
+    filter_place(f, h, pos, slot);
+}
+
+void
+filter_push(struct filter_state* f, struct filter_heap* h, int slot)
+{
+    filter_place(f, h, h->n++, slot);
+    filter_sift(f, h, h->n - 1);
+}
+
+int
+filter_pop(struct filter_state* f, struct filter_heap* h)
+{
+    int slot = h->slots[0];
+
+    if (--h->n > 0)
+    {
+        filter_place(f, h, 0, h->slots[h->n]);
+        filter_sift(f, h, 0);
+    }
+
+    return slot;
+}
+
+struct filter_state*
+filter_new(void)
+{
+    struct filter_state *f;
+    int i;
+
+    f = calloc(1, sizeof(struct filter_state));
+    f->values = calloc(filter.n, sizeof(double));
+    f->heap = calloc(filter.n, 1);
+    f->pos = calloc(filter.n, sizeof(int));
+    for (i = 0; i < 2; i++)
+    {
+        f->heaps[i].slots = calloc(filter.n, sizeof(int));
+        f->heaps[i].sign = i ? -1 : 1;
+    }
+
+    return f;
+}
+
+/*
+ * Add a reading to the window.
+ */
+void
+filter_add(struct filter_state* f, double v)
+{
+    struct filter_heap *lower = &f->heaps[0];
+    struct filter_heap *upper = &f->heaps[1];
+    int slot;
+
+    if (f->count < filter.n)
+    {
+        slot = f->count++;
+        f->values[slot] = v;
+        filter_count(f, v, 1);
+
+        if ((lower->n == 0) || (v <= f->values[lower->slots[0]]))
+            filter_push(f, lower, slot);
+        else
+            filter_push(f, upper, slot);
+
+        /* Keep the lower half the same size or one bigger. */
+        if (lower->n > upper->n + 1)
+            filter_push(f, upper, filter_pop(f, lower));
+        else if (upper->n > lower->n)
+            filter_push(f, lower, filter_pop(f, upper));
+        return;
+    }
+
+    /* Replace the oldest reading. */
+    slot = f->next;
+    f->next = (f->next + 1) % filter.n;
+    filter_count(f, f->values[slot], -1);
+    f->values[slot] = v;
+    filter_count(f, v, 1);
+    filter_sift(f, &f->heaps[f->heap[slot]], f->pos[slot]);
+
+    if (upper->n && (f->values[lower->slots[0]] > f->values[upper->slots[0]]))
+    {
+        slot = lower->slots[0];
+        filter_place(f, lower, 0, upper->slots[0]);
+        filter_place(f, upper, 0, slot);
+        filter_sift(f, lower, 0);
+        filter_sift(f, upper, 0);
+    }
+}
+
+/*
+ * Work out the set up from the options.
+ */
+void
+filter_init(void)
+{
+    filter.log_gamma = log((1 + FILTER_ALPHA) / (1 - FILTER_ALPHA));
+    filter.keys = ceil(log(FILTER_RANGE) / filter.log_gamma);
+}
+
+/*
+ * Add a decoded sample to its meter's window, and fill in the
+ * sample's median and percentiles.  Only the meter's reader thread
+ * calls this.
+ */
+void
+filter_update(struct sample* s)
+{
+    struct meter *m = s->meter;
+    struct filter_state *f = m->filter;
+    unsigned long mode = s->attributes & DETECT_MODE;
+    double *values;
+    double quantum;
+    double v;
+    int rank;
+    int n;
+
+    if (f == NULL)
+        f = m->filter = filter_new();
+
+    if (mode != f->mode)
+    {
+        f->mode = mode;
+        f->count = 0;
+        f->next = 0;
+        f->heaps[0].n = 0;
+        f->heaps[1].n = 0;
+        free(f->counts);
+        free(f->tree);
+        f->counts = f->tree = NULL;
+        f->size = 0;
+    }
+
+    if (!s->overload && !isnan(s->value))
+        filter_add(f, s->value);
+
+    s->filtered = f->count;
+    if (f->count == 0)
+        return;
+
+    values = f->values;
+    if (f->count % 2)
+        s->median = values[f->heaps[0].slots[0]];
+    else
+        s->median = (values[f->heaps[0].slots[0]] +
+            values[f->heaps[1].slots[0]]) / 2;
+
+    for (n = 0; n < filter.npercentiles; n++)
+    {
+        rank = filter.percentiles[n] / 100 * (f->count - 1) + 0.5;
+        v = filter_bin_value(filter_rank(f, rank));
+
+        /* Round to the four digits the reading was shown with. */
+        if ((v != 0) && (m->ncalibrations == 0))
+        {
+            quantum = pow(10, floor(log10(fabs(v))) - 3);
+            v = round(v / quantum) * quantum;
+        }
+        s->percentiles[n] = v;
+    }
+}
+
+/*
+ * Parse "n[:p,...]".
+ */
+int
+filter_parse(char* spec)
+{
+    char *end;
+    char *p;
+
+    filter.n = strtol(spec, &end, 10);
+    if (filter.n < 1)
+        return -1;
+
+    if (*end == ':')
+    {
+        do
+        {
+            if (filter.npercentiles == FILTER_PERCENTILES)
+                return -1;
+            p = end + 1;
+            filter.percentiles[filter.npercentiles] = strtod(p, &end);
+            if ((end == p) || (filter.percentiles[filter.npercentiles] < 0) ||
+                (filter.percentiles[filter.npercentiles] > 100))
+                return -1;
+            filter.npercentiles++;
+        } while (*end == ',');
+    }
+
+    if (*end)
+        return -1;
+
+    filter_init();
+
+    return 0;
+}
+
+/*
+ ****************************************************************
+ *
+ * Calibration.
+ *
+ ****************************************************************
+ */
+
+/*
+ * "-c file" corrects each meter's readings from its calibration
+ * certificate, with a table of points for each mode and range:
+ *
+ *   # meter  mode  resolution  reading  true
+ *   psu      DCV   0.01        5.00     5.003
+ *   psu      DCV   0.01        12.00    12.011
+ *   *        Ohm   *           100.0    100.2
+ *
+ * The mode is the unit, with AC or DC in front for volts and amps
+ * (DCV, ACA, Ohm, F, Hz, degC, %), and the resolution is what one
+ * count of the display is worth in that range, in base units, or "*"
+ * for any range.  A meter of "*" is any meter.  Readings and true
+ * values are in base units.
+ *
+ * A reading is corrected by linear interpolation between the points
+ * either side of it, found by binary search, or extrapolated from the
+ * nearest two, or offset by the difference at a lone point.  It is
+ * all done in fixed point from the count shown, keeping three more
+ * digits than the display or the table, whichever has more, so
+ * corrections are exact decimals and the same every time.  The
+ * corrected reading replaces the count, value and display of the
+ * sample before it goes anywhere.  Readings that would need more than
+ * CALIBRATE_DIGITS decimal places are left alone.
+ *
+ * Replaying captures with "-c" is the way to correct stored readings:
+ * "serial-meter -q -c cal -r capture -x dir" for instance.
+ */
+#define CALIBRATE_ANY	99	/* As the exponent: any range. */
+#define CALIBRATE_EXTRA	3	/* Digits kept beyond the display. */
+#define CALIBRATE_DIGITS 18	/* Most in a number, to fit 64 bits. */
+
+struct calibration_point
+{
+    long long reading;		/* At the table's scale. */
+    long long truth;
+};
+
+struct calibration
+{
+    char *meter;
+    int unit;			/* In unit_table[], */
+    unsigned long acdc;		/* with ATTR_AC or ATTR_DC, */
+    int exponent;		/* and range, the power of ten of a count. */
+    int scale;			/* Decimal places of the points. */
+    struct calibration_point *points;	/* In order of reading. */
+    int npoints;
+};
+
+struct calibration *calibrations;
+int ncalibrations;
+
+int format_fixed(char* p, long count, int exp);
+
+static const __int128 calibrate_powers[] =
+{
+    1LL, 10LL, 100LL, 1000LL, 10000LL, 100000LL, 1000000LL, 10000000LL,
+    100000000LL, 1000000000LL, 10000000000LL, 100000000000LL,
+    1000000000000LL, 10000000000000LL, 100000000000000LL,
+    1000000000000000LL, 10000000000000000LL, 100000000000000000LL,
+    1000000000000000000LL
+};
+
+/*
+ * Parse a decimal number exactly, as digits and decimal places.
+ */
+int
+calibrate_number(char* str, long long* digits, int* places)
+{
+    int ndigits = 0;
+    int point = 0;
+    int sign = 1;
+
+    *digits = 0;
+    *places = 0;
+
+    if (*str == '-')
+    {
+        sign = -1;
+        str++;
+    }
+
+    for (; *str; str++)
+    {
+        if ((*str == '.') && !point)
+            point = 1;
+        else if (isdigit((unsigned char)*str) &&
+            (++ndigits <= CALIBRATE_DIGITS))
+        {
+            *digits = *digits * 10 + (*str - '0');
+            *places += point;
+        }
+        else
+            return -1;
+    }
+
+    if (ndigits == 0)
+        return -1;
+
+    *digits *= sign;
+
+    return 0;
+}
+
+/*
+ * Parse a mode such as "DCV" or "Ohm".
+ */
+int
+calibrate_mode(char* str, unsigned long* acdc)
+{
+    int n;
+
+    *acdc = 0;
+    if (strncmp(str, "AC", 2) == 0)
+        *acdc = ATTR_AC;
+    else if (strncmp(str, "DC", 2) == 0)
+        *acdc = ATTR_DC;
+    if (*acdc)
+        str += 2;
+
+    for (n = 1; n < NUNITS; n++)
+    {
+        if (strcmp(str, unit_table[n].name) == 0)
+            return n;
+    }
+
+    return -1;
+}
+
+int
+calibrate_compare(const void* a, const void* b)
+{
+    const struct calibration_point *pa = a;
+    const struct calibration_point *pb = b;
+
+    return (pa->reading > pb->reading) - (pa->reading < pb->reading);
+}
+
+/*
+ * Add a point to its table, rescaling the table if the point has more
+ * decimal places.
+ */
+int
+calibrate_add(char* meter, int unit, unsigned long acdc, int exponent,
+    long long reading, int rplaces, long long truth, int tplaces)
+{
+    struct calibration *c = NULL;
+    long long mul;
+    int scale;
+    int n;
+
+    for (n = 0; n < ncalibrations; n++)
+    {
+        c = &calibrations[n];
+        if ((strcmp(c->meter, meter) == 0) && (c->unit == unit) &&
+            (c->acdc == acdc) && (c->exponent == exponent))
+            break;
+    }
+
+    if (n == ncalibrations)
+    {
+        calibrations = realloc(calibrations,
+            ++ncalibrations * sizeof(struct calibration));
+        c = &calibrations[n];
+        memset(c, 0, sizeof(*c));
+        c->meter = strdup(meter);
+        c->unit = unit;
+        c->acdc = acdc;
+        c->exponent = exponent;
+    }
+
+    scale = c->scale;
+    if (rplaces > scale)
+        scale = rplaces;
+    if (tplaces > scale)
+        scale = tplaces;
+
+    /* Everything must still fit at the new scale. */
+    for (n = 0; n < c->npoints; n++)
+    {
+        mul = calibrate_powers[scale - c->scale];
+        if ((llabs(c->points[n].reading) > LLONG_MAX / mul) ||
+            (llabs(c->points[n].truth) > LLONG_MAX / mul))
+            return -1;
+        c->points[n].reading *= mul;
+        c->points[n].truth *= mul;
+    }
+    c->scale = scale;
+
+    if ((llabs(reading) > LLONG_MAX / calibrate_powers[scale - rplaces]) ||
+        (llabs(truth) > LLONG_MAX / calibrate_powers[scale - tplaces]))
+        return -1;
+
+    c->points = realloc(c->points,
+        (c->npoints + 1) * sizeof(struct calibration_point));
+    c->points[c->npoints].reading = reading * calibrate_powers[scale - rplaces];
+    c->points[c->npoints].truth = truth * calibrate_powers[scale - tplaces];
+    c->npoints++;
+
+    qsort(c->points, c->npoints, sizeof(struct calibration_point),
+        calibrate_compare);
+
+    for (n = 1; n < c->npoints; n++)
+    {
+        if (c->points[n].reading == c->points[n - 1].reading)
+            return -1;
+    }
+
+    return 0;
+}
+
+int
+calibrate_load(char* file)
+{
+    char line[256];
+    char meter[32];
+    char mode[16];
+    char range[32];
+    char reading[32];
+    char truth[32];
+    char extra[2];
+    long long digits;
+    long long r;
+    long long t;
+    unsigned long acdc;
+    char *p;
+    FILE *f;
+    int lineno = 0;
+    int exponent;
+    int places;
+    int rplaces;
+    int tplaces;
+    int unit;
+
+    f = fopen(file, "r");
+    if (f == NULL)
+    {
+        perror(file);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f))
+    {
+        lineno++;
+        p = line + strspn(line, " \t");
+        if ((*p == '#') || (*p == '\n') || (*p == '\0'))
+            continue;
+
+        if (sscanf(p, "%31s %15s %31s %31s %31s %1s", meter, mode, range,
+            reading, truth, extra) != 5)
+            goto bad;
+
+        unit = calibrate_mode(mode, &acdc);
+        if (unit < 0)
+            goto bad;
+
+        /* The resolution must be a power of ten. */
+        exponent = CALIBRATE_ANY;
+        if (strcmp(range, "*") != 0)
+        {
+            if (calibrate_number(range, &digits, &places) || (digits <= 0))
+                goto bad;
+            for (exponent = -places; digits % 10 == 0; digits /= 10)
+                exponent++;
+            if (digits != 1)
+                goto bad;
+        }
+
+        if (calibrate_number(reading, &r, &rplaces) ||
+            calibrate_number(truth, &t, &tplaces) ||
+            calibrate_add(meter, unit, acdc, exponent, r, rplaces, t,
+                tplaces))
+            goto bad;
+    }
+
+    fclose(f);
+    return 0;
+
+bad:
+    printf("%s:%d: can't make sense of \"%.*s\"\n", file, lineno,
+        (int)strcspn(line, "\n"), line);
+    fclose(f);
+    return -1;
+}
+
+/*
+ * Give each meter the tables that are for it, its own ahead of those
+ * for any meter, and the range specific ahead of those for any range.
+ */
+void
+calibrate_start(void)
+{
+    struct meter *m;
+    int pass;
+    int n;
+    int i;
+
+    for (n = 0; n < nmeters; n++)
+    {
+        m = &meters[n];
+        for (pass = 0; pass < 4; pass++)
+        {
+            for (i = 0; i < ncalibrations; i++)
+            {
+                if ((strcmp(calibrations[i].meter,
+                    (pass & 2) ? "*" : m->name) != 0) ||
+                    ((calibrations[i].exponent == CALIBRATE_ANY) !=
+                    (pass & 1)))
+                    continue;
+
+                m->calibrations = realloc(m->calibrations,
+                    (m->ncalibrations + 1) * sizeof(struct calibration *));
+                m->calibrations[m->ncalibrations++] = &calibrations[i];
+            }
+        }
+    }
+}
+
+/*
+ * Correct a decoded sample.
+ */
+void
+calibrate(struct sample* s)
+{
+    struct meter *m = s->meter;
+    struct calibration *c = NULL;
+    struct calibration_point *p;
+    unsigned long acdc = s->attributes & (ATTR_AC | ATTR_DC);
+    __int128 x;
+    __int128 y;
+    long long dx;
+    char display[48];
+    int unit;
+    int exp;
+    int scale;
+    int len;
+    int lo;
+    int hi;
+    int n;
+
+    if (s->overload)
+        return;
+
+    unit = attribute_unit_index(s->attributes);
+    exp = sample_exponent(s);
+    for (n = 0; n < m->ncalibrations; n++)
+    {
+        c = m->calibrations[n];
+        if ((c->unit == unit) && (c->acdc == acdc) &&
+            ((c->exponent == exp) || (c->exponent == CALIBRATE_ANY)))
+            break;
+    }
+    if (n == m->ncalibrations)
+        return;
+
+    /* Work to a scale finer than both the display and the table. */
+    scale = (c->scale > -exp) ? c->scale : -exp;
+    scale += CALIBRATE_EXTRA;
+    if ((scale > CALIBRATE_DIGITS) || (scale + exp > CALIBRATE_DIGITS))
+        return;
+
+    x = s->count * calibrate_powers[scale + exp];
+
+    /* Find the segment, the last whose first point is below x. */
+    lo = 0;
+    hi = c->npoints - 1;
+    while (hi - lo > 1)
+    {
+        n = (lo + hi) / 2;
+        if (c->points[n].reading * calibrate_powers[scale - c->scale] <= x)
+            lo = n;
+        else
+            hi = n;
+    }
+
+    p = &c->points[lo];
+    y = (__int128)p->truth * calibrate_powers[scale - c->scale];
+    if (c->npoints == 1)
+        y += x - (__int128)p->reading * calibrate_powers[scale - c->scale];
+    else
+    {
+        /* The slope is the same at any scale. */
+        x -= (__int128)p->reading * calibrate_powers[scale - c->scale];
+        x *= p[1].truth - p[0].truth;
+        dx = p[1].reading - p[0].reading;
+
+        /* Round to the nearest, either side of zero. */
+        y += ((x < 0) ? x - dx / 2 : x + dx / 2) / dx;
+    }
+
+    /* Drop the extra digits that are zero. */
+    while ((scale > -exp) && (y % 10 == 0))
+    {
+        y /= 10;
+        scale--;
+    }
+
+    if ((y > LONG_MAX) || (y < -LONG_MAX))
+        return;
+
+    s->count = y;
+    s->decimals = attribute_exponent(s->attributes) + scale;
+    s->value = sample_value(s);
+
+    len = format_fixed(display, s->count, -s->decimals);
+    if (len < (int)sizeof(s->display))
+    {
+        memcpy(s->display, display, len);
+        s->display[len] = '\0';
+    }
+}
+
+/*
+ ****************************************************************
+ *
+ * Configuration.
+ *
+ ****************************************************************
+ */
+
+/*
+ * "-k file" takes settings from a file as well as the command line,
+ * and applies them again whenever the file is saved, without a
+ * restart and without disturbing the readers.  Each line is a setting
+ * and its value:
+ *
+ *   # Quieter, and with line protocol going to telegraf.
+ *   quiet yes
+ *   detect 4:8
+ *   mqtt off
+ *   influx unix:///run/telegraf.sock
+ *
+ * "detect", "mqtt" and "influx" take what -D, -m and -i do, or "off".
+ * A setting left out of the file is as the command line had it.  The
+ * ports, and what is set up for each meter, stay as they started.
+ *
+ * The settings in force are a snapshot that isn't changed once
+ * published.  A reload builds a new one and swaps the pointer, RCU
+ * style: threads that use the settings bracket each use with
+ * config_read() and config_done(), which only count in a word of the
+ * thread's own, and the old snapshot is freed once each thread that
+ * was in the middle of using it has been seen to finish.  Readers
+ * never wait for a reload.  When a thread exits, its word is left for
+ * the next thread to start reading rather than unlinked, as a reload
+ * may be looking at it.
+ */
+struct config
+{
+    int quiet;			/* Don't print samples on stdout. */
+    struct detect detect;
+    char *broker;		/* MQTT broker, or NULL. */
+    char *influx;		/* Line protocol destination, or NULL. */
+};
+
+/* A thread that reads the settings. */
+struct config_reader
+{
+    _Atomic unsigned long seq;	/* Odd while reading. */
+    int depth;
+    _Atomic int idle;		/* Its thread has exited. */
+    struct config_reader *next;
+};
+
+struct
+{
+    char *file;
+    struct config defaults;	/* From the command line. */
+    struct config *_Atomic current;
+    struct config_reader *_Atomic readers;
+    pthread_key_t key;		/* To see the readers exit. */
+    pthread_once_t once;
+    pthread_t thread;
+} config =
+{
+    .defaults.detect.h = DETECT_CUSUM,
+    .once = PTHREAD_ONCE_INIT
+};
+
+_Thread_local struct config_reader *config_self;
+
+int mqtt_start(char* broker);
+int influx_start(char* dest);
+
+/*
+ * A thread that read the settings has exited.
+ */
+void
+config_exited(void* arg)
+{
+    struct config_reader *r = arg;
+
+    r->idle = 1;
+}
+
+void
+config_key_create(void)
+{
+    pthread_key_create(&config.key, config_exited);
+}
+
+/*
+ * Get the settings, which stay valid until config_done().  Reads can
+ * nest.
+ */
+struct config*
+config_read(void)
+{
+    struct config_reader *r = config_self;
+    int idle;
+
+    if (r == NULL)
+    {
+        pthread_once(&config.once, config_key_create);
+
+        /* Take the word of a thread that has exited, or add one. */
+        for (r = config.readers; r != NULL; r = r->next)
+        {
+            idle = 1;
+            if (atomic_compare_exchange_strong(&r->idle, &idle, 0))
+                break;
+        }
+
+        if (r == NULL)
+        {
+            r = calloc(1, sizeof(*r));
+            r->next = config.readers;
+            while (!atomic_compare_exchange_weak(&config.readers, &r->next,
+                r))
+                ;
+        }
+
+        pthread_setspecific(config.key, r);
+        config_self = r;
+    }
+
+    if (r->depth++ == 0)
+        r->seq++;
+
+    return config.current;
+}
+
+void
+config_done(void)
+{
+    struct config_reader *r = config_self;
+
+    if (--r->depth == 0)
+        r->seq++;
+}
+
+void
+config_free(struct config* c)
+{
+    free(c->broker);
+    free(c->influx);
+    free(c);
+}
+
+/*
+ * Publish new settings, and free the old ones once no thread can still
+ * be using them.
+ */
+void
+config_publish(struct config* c)
+{
+    struct config_reader *r;
+    struct config *old;
+    unsigned long seq;
+
+    old = atomic_exchange(&config.current, c);
+
+    for (r = config.readers; r != NULL; r = r->next)
+    {
+        seq = r->seq;
+        while ((seq & 1) && (r->seq == seq))
+            poll(NULL, 0, 1);
+    }
+
+    if (old)
+        config_free(old);
+}
+
+/*
+ * Parse "z[:h]" as for -D.
+ */
+int
+config_detect(char* spec, struct detect* d)
+{
+    char *end;
+
+    d->z = strtod(spec, &end);
+    d->h = DETECT_CUSUM;
+    if (*end == ':')
+        d->h = strtod(end + 1, &end);
+
+    return (*end || (d->z <= 0) || (d->h <= 0)) ? -1 : 0;
+}
+
+/*
+ * Read the file over a copy of the command line's settings.  Returns
+ * NULL, having said why, if the file doesn't make sense.
+ */
+struct config*
+config_load(void)
+{
+    struct config *c;
+    char line[256];
+    char key[16];
+    char value[224];
+    char **dest;
+    char *p;
+    FILE *f;
+    int lineno = 0;
+
+    c = malloc(sizeof(*c));
+    *c = config.defaults;
+    c->broker = c->broker ? strdup(c->broker) : NULL;
+    c->influx = c->influx ? strdup(c->influx) : NULL;
+
+    if (config.file == NULL)
+        return c;
+
+    f = fopen(config.file, "r");
+    if (f == NULL)
+    {
+        perror(config.file);
+        config_free(c);
+        return NULL;
+    }
+
+    while (fgets(line, sizeof(line), f))
+    {
+        lineno++;
+        p = line + strspn(line, " \t");
+        if ((*p == '#') || (*p == '\n') || (*p == '\0'))
+            continue;
+
+        if (sscanf(p, "%15s %223s", key, value) < 2)
+            goto bad;
+
+        if (strcmp(key, "quiet") == 0)
+        {
+            if (strcmp(value, "yes") == 0)
+                c->quiet = 1;
+            else if (strcmp(value, "no") == 0)
+                c->quiet = 0;
+            else
+                goto bad;
+        }
+        else if (strcmp(key, "detect") == 0)
+        {
+            if (strcmp(value, "off") == 0)
+                c->detect.z = 0;
+            else if (config_detect(value, &c->detect) < 0)
+                goto bad;
+        }
+        else if ((strcmp(key, "mqtt") == 0) || (strcmp(key, "influx") == 0))
+        {
+            dest = (key[0] == 'm') ? &c->broker : &c->influx;
+            free(*dest);
+            *dest = (strcmp(value, "off") == 0) ? NULL : strdup(value);
+        }
+        else
+            goto bad;
+    }
+
+    fclose(f);
+    return c;
+
+bad:
+    printf("%s:%d: can't make sense of \"%.*s\"\n", config.file, lineno,
+        (int)strcspn(line, "\n"), line);
+    fclose(f);
+    config_free(c);
+    return NULL;
+}
+
+/*
+ * Start any outputs the settings need that aren't running yet, then
+ * publish them.
+ */
+int
+config_apply(struct config* c)
+{
+    if (c->broker && mqtt_start(c->broker))
+    {
+        printf("Couldn't start MQTT publisher\n");
+        config_free(c);
+        return -1;
+    }
+
+    if (c->influx && influx_start(c->influx))
+    {
+        printf("Couldn't start line protocol output\n");
+        config_free(c);
+        return -1;
+    }
+
+    config_publish(c);
+
+    return 0;
+}
+
+/*
+ * Reload the file whenever it is written.  Its directory is watched
+ * rather than the file, as editors often save by renaming a new file
+ * over the old one.
+ */
+void*
+config_thread(void* arg)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    struct config *c;
+    char *copy;
+    char *dir;
+    char *name;
+    char *p;
+    ssize_t len;
+    int changed;
+    int fd;
+
+    (void)arg;
+
+    /* dir points into copy, or at "." or "/" which aren't to be freed. */
+    copy = strdup(config.file);
+    if (copy == NULL)
+        return NULL;
+    name = strrchr(copy, '/');
+    if (name == NULL)
+    {
+        name = config.file;
+        dir = ".";
+    }
+    else
+    {
+        *name++ = '\0';
+        dir = copy[0] ? copy : "/";
+    }
+
+    fd = inotify_init1(IN_CLOEXEC);
+    if ((fd < 0) ||
+        (inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0))
+    {
+        perror(config.file);
+        if (fd >= 0)
+            close(fd);
+        free(copy);
+        return NULL;
+    }
+
+    for (;;)
+    {
+        len = read(fd, buf, sizeof(buf));
+        if (len <= 0)
+        {
+            if ((len < 0) && (errno == EINTR))
+                continue;
+            perror(config.file);
+            break;
+        }
+
+        changed = 0;
+        for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len)
+        {
+            ev = (struct inotify_event *)p;
+            if (ev->len && (strcmp(ev->name, name) == 0))
+                changed = 1;
+        }
+        if (!changed)
+            continue;
+
+        c = config_load();
+        if ((c == NULL) || config_apply(c))
+            printf("%s: keeping the settings as they were\n", config.file);
+        else
+            printf("%s: reloaded\n", config.file);
+    }
+
+    close(fd);
+    free(copy);
+    return NULL;
+}
+
+/*
+ * Load the settings, start the outputs they need, and watch for them
+ * changing.
+ */
+int
+config_start(void)
+{
+    struct config *c;
+
+    c = config_load();
+    if ((c == NULL) || config_apply(c))
+        return -1;
+
+    if (config.file)
+        pthread_create(&config.thread, NULL, config_thread, NULL);
+
+    return 0;
+}
+
+/*
+ ****************************************************************
+ *
+ * MQTT output.
+ *
+ ****************************************************************
+ */
+
+/*
+ * Samples can be published to an MQTT broker, on the topic
+ * "<prefix>/<meter name>", as small JSON objects.
+ *
+ * The reader threads only add samples to a queue.  A single
+ * publisher thread sends whatever has built up as one batch of back
+ * to back QoS 0 PUBLISH packets on a persistent connection, so a slow
+ * broker never holds up the serial ports.  While the broker is
+ * unreachable the queue keeps the most recent MQTT_QUEUE samples and
+ * drops older ones.
+ */
+#define MQTT_PORT	"1883"
+#define MQTT_QUEUE	16384	/* Samples kept while the broker is down. */
+#define MQTT_BATCH	256	/* Most samples sent in one write. */
+#define MQTT_LINGER	20	/* ms to wait for more samples to batch up. */
+#define MQTT_KEEPALIVE	60	/* seconds */
+#define MQTT_TOPIC	248	/* Longest topic, with "/events". */
+
+#define MQTT_CONNECT	0x10
+#define MQTT_CONNACK	0x20
+#define MQTT_PUBLISH	0x30
+#define MQTT_PINGREQ	0xC0
+#define MQTT_DISCONNECT	0xE0
+
+struct mqtt
+{
+    char *broker;		/* As given, */
+    char *host;			/* and split up, NULL if not publishing. */
+    char *service;
+    char *prefix;
+    int fd;
+    int backoff;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct sample *queue;
+    /*
+     * These are only changed with the lock held, but are atomic so
+     * that the HTTP server can read them without it.
+     */
+    _Atomic unsigned long head;	/* Count of samples queued. */
+    _Atomic unsigned long tail;	/* Count of samples sent or dropped. */
+    _Atomic unsigned long dropped;
+    int done;			/* No more samples are coming. */
+    pthread_t thread;
+};
+
+struct mqtt mqtt =
+{
+    .prefix = "serial-meter",
+    .fd = -1,
+    .backoff = BACKOFF_MIN,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+/*
+ * Queue a sample for publishing.  Called by the reader threads.
+ */
+void
+mqtt_queue(struct sample* s)
+{
+    pthread_mutex_lock(&mqtt.lock);
+
+    if (mqtt.head - mqtt.tail == MQTT_QUEUE)
+    {
+        /* Full, lose the oldest sample. */
+        mqtt.tail++;
+        mqtt.dropped++;
+    }
+    mqtt.queue[mqtt.head % MQTT_QUEUE] = *s;
+    mqtt.head++;
+
+    pthread_cond_signal(&mqtt.cond);
+    pthread_mutex_unlock(&mqtt.lock);
+}
+
+/*
+ * Encode an MQTT "remaining length".
+ */
+int
+mqtt_put_length(unsigned char* p, unsigned long len)
+{
+    int n = 0;
+
+    do
+    {
+        p[n] = len & 0x7F;
+        len >>= 7;
+        if (len)
+            p[n] |= 0x80;
+        n++;
+    } while (len);
+
+    return n;
+}
+
+int
+mqtt_put_string(unsigned char* p, char* str, int len)
+{
+    p[0] = len >> 8;
+    p[1] = len & 0xFF;
+    memcpy(p + 2, str, len);
+
+    return len + 2;
+}
+
+/*
+ * Write a whole buffer to a socket.
+ */
+int
+write_all(int fd, void* buf, size_t len)
+{
+    char *p = buf;
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = write(fd, p, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * Connect to the broker and send CONNECT.  Returns 0 once the broker
+ * has accepted us.
+ */
+int
+mqtt_connect(void)
+{
+    unsigned char pkt[64];
+    unsigned char ack[4];
+    char id[32];
+    int idlen;
+    int len;
+
+    mqtt.fd = tcp_connect(mqtt.host, mqtt.service);
+    if (mqtt.fd < 0)
+        return -1;
+
+    idlen = sprintf(id, "serial-meter-%d", (int)getpid());
+
+    pkt[0] = MQTT_CONNECT;
+    pkt[1] = 10 + 2 + idlen;
+    len = 2;
+    len += mqtt_put_string(pkt + len, "MQTT", 4);
+    pkt[len++] = 4;		/* Protocol level, 3.1.1 */
+    pkt[len++] = 0x02;		/* Clean session */
+    pkt[len++] = MQTT_KEEPALIVE >> 8;
+    pkt[len++] = MQTT_KEEPALIVE & 0xFF;
+    len += mqtt_put_string(pkt + len, id, idlen);
+
+    if ((write_all(mqtt.fd, pkt, len) < 0) ||
+        (recv(mqtt.fd, ack, 4, MSG_WAITALL) != 4) ||
+        (ack[0] != MQTT_CONNACK) || (ack[3] != 0))
+    {
+        printf("mqtt: %s:%s refused connection\n", mqtt.host, mqtt.service);
+        close(mqtt.fd);
+        mqtt.fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+mqtt_disconnect(void)
+{
+    close(mqtt.fd);
+    mqtt.fd = -1;
+}
+
+/*
+ * Append a PUBLISH packet for a sample to buf.
+ */
+int
+mqtt_format(unsigned char* buf, struct sample* s)
+{
+    char payload[SAMPLE_JSON];
+    char events[MQTT_TOPIC + 1];
+    char *topic = s->meter->topic;
+    int topiclen;
+    int plen;
+    int len;
+
+    plen = sample_json(payload, s, NULL);
+
+    /* Events go to a topic of their own under the meter's. */
+    if (s->event)
+    {
+        snprintf(events, sizeof(events), "%s/events", topic);
+        topic = events;
+    }
+    topiclen = strlen(topic);
+
+    buf[0] = MQTT_PUBLISH;
+    len = 1 + mqtt_put_length(buf + 1, 2 + topiclen + plen);
+    len += mqtt_put_string(buf + len, topic, topiclen);
+    memcpy(buf + len, payload, plen);
+
+    return len + plen;
+}
+
+/*
+ * Throw away whatever the broker sent us (PINGRESPs).  Returns -1 if
+ * it closed the connection.
+ */
+int
+mqtt_drain(void)
+{
+    char junk[64];
+    ssize_t n;
+
+    while ((n = recv(mqtt.fd, junk, sizeof(junk), MSG_DONTWAIT)) > 0)
+        ;
+
+    if ((n == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK)))
+        return -1;
+
+    return 0;
+}
+
+void
+mqtt_set_broker(char* broker)
+{
+    /* Any old host is a copy of its own, see parse_host_port(). */
+    if (mqtt.host != mqtt.broker)
+        free(mqtt.host);
+    free(mqtt.broker);
+
+    mqtt.broker = strdup(broker);
+    if (parse_host_port(broker, &mqtt.host, &mqtt.service))
+    {
+        mqtt.host = mqtt.broker;
+        mqtt.service = MQTT_PORT;
+    }
+}
+
+/*
+ * Move to another broker if a reload asked for one.  The samples
+ * still queued go to the new one.
+ */
+void
+mqtt_follow(void)
+{
+    struct config *c = config_read();
+    char *broker = NULL;
+
+    /* c is NULL until config_apply() has started us and published. */
+    if (c && c->broker && strcmp(c->broker, mqtt.broker))
+        broker = strdup(c->broker);
+    config_done();
+
+    if (broker == NULL)
+        return;
+
+    printf("mqtt: switching to %s\n", broker);
+    if (mqtt.fd >= 0)
+        mqtt_disconnect();
+    mqtt_set_broker(broker);
+    mqtt.backoff = BACKOFF_MIN;
+    free(broker);
+}
+
+/*
+ * The publisher thread.
+ */
+void*
+mqtt_thread(void* arg)
+{
+    static struct sample batch[MQTT_BATCH];
+    static unsigned char buf[MQTT_BATCH * (SAMPLE_JSON + MQTT_TOPIC + 8)];
+    unsigned char ping[2] = { MQTT_PINGREQ, 0 };
+    unsigned long end;
+    unsigned long dropped;
+    unsigned long reported = 0;
+    struct timespec deadline;
+    long long start;
+    int len;
+    int n;
+    int i;
+
+    (void)arg;
+
+    trace_thread("mqtt");
+
+    for (;;)
+    {
+        mqtt_follow();
+
+        if (mqtt.fd < 0)
+        {
+            if (mqtt_connect() == 0)
+            {
+                mqtt.backoff = BACKOFF_MIN;
+
+                dropped = mqtt.dropped;
+                if (dropped != reported)
+                    printf("mqtt: dropped %lu samples while disconnected\n",
+                        dropped - reported);
+                reported = dropped;
+            }
+            else
+            {
+                if (mqtt.done)
+                    break;
+                backoff_wait(&mqtt.backoff);
+                continue;
+            }
+        }
+
+        /* Wait for samples, pinging the broker if there aren't any. */
+        pthread_mutex_lock(&mqtt.lock);
+        while ((mqtt.head == mqtt.tail) && !mqtt.done)
+        {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += MQTT_KEEPALIVE / 2;
+            if (pthread_cond_timedwait(&mqtt.cond, &mqtt.lock, &deadline))
+                break;
+        }
+
+        if ((mqtt.head == mqtt.tail) && mqtt.done)
+        {
+            pthread_mutex_unlock(&mqtt.lock);
+            break;
+        }
+
+        if (mqtt.head == mqtt.tail)
+        {
+            pthread_mutex_unlock(&mqtt.lock);
+            if ((write_all(mqtt.fd, ping, 2) < 0) || (mqtt_drain() < 0))
+                mqtt_disconnect();
+            continue;
+        }
+
+        /* Give the other meters a moment to add to the batch. */
+        if ((mqtt.head - mqtt.tail < MQTT_BATCH) && !mqtt.done)
+        {
+            pthread_mutex_unlock(&mqtt.lock);
+            poll(NULL, 0, MQTT_LINGER);
+            pthread_mutex_lock(&mqtt.lock);
+        }
+
+        n = mqtt.head - mqtt.tail;
+        if (n > MQTT_BATCH)
+            n = MQTT_BATCH;
+        for (i = 0; i < n; i++)
+            batch[i] = mqtt.queue[(mqtt.tail + i) % MQTT_QUEUE];
+        end = mqtt.tail + n;
+        pthread_mutex_unlock(&mqtt.lock);
+
+        start = trace_begin();
+        len = 0;
+        for (i = 0; i < n; i++)
+            len += mqtt_format(buf + len, &batch[i]);
+
+        /*
+         * If the write fails the samples stay queued and are sent
+         * again after reconnecting.
+         */
+        i = (write_all(mqtt.fd, buf, len) < 0) || (mqtt_drain() < 0);
+        trace_end("mqtt_publish", start, n);
+        DTRACE_PROBE3(serial_meter, mqtt_flush, n, len, i);
+        if (i)
+        {
+            printf("mqtt: lost connection to %s:%s\n",
+                mqtt.host, mqtt.service);
+            mqtt_disconnect();
+            continue;
+        }
+
+        pthread_mutex_lock(&mqtt.lock);
+        if ((long)(end - mqtt.tail) > 0)
+            mqtt.tail = end;
+        pthread_mutex_unlock(&mqtt.lock);
+    }
+
+    if (mqtt.fd >= 0)
+    {
+        unsigned char bye[2] = { MQTT_DISCONNECT, 0 };
+
+        write_all(mqtt.fd, bye, 2);
+        mqtt_disconnect();
+    }
+
+    return NULL;
+}
+
+/*
+ * Start publishing to "host[:port]", if not already.
+ */
+int
+mqtt_start(char* broker)
+{
+    char *topic;
+    int n;
+
+    if (mqtt.queue)
+        return 0;
+
+    /* A PUBLISH has room for MQTT_TOPIC bytes of topic, see mqtt_thread(). */
+    for (n = 0; n < nmeters; n++)
+    {
+        if (strlen(mqtt.prefix) + strlen(meters[n].name) + 8 > MQTT_TOPIC)
+        {
+            printf("mqtt: topic \"%s/%s\" is too long\n", mqtt.prefix,
+                meters[n].name);
+            return -1;
+        }
+    }
+
+    mqtt_set_broker(broker);
+
+    for (n = 0; n < nmeters; n++)
+    {
+        topic = malloc(strlen(mqtt.prefix) + strlen(meters[n].name) + 2);
+        sprintf(topic, "%s/%s", mqtt.prefix, meters[n].name);
+        meters[n].topic = topic;
+    }
+
+    mqtt.queue = calloc(MQTT_QUEUE, sizeof(struct sample));
+
+    return pthread_create(&mqtt.thread, NULL, mqtt_thread, NULL);
+}
+
+void
+mqtt_stop(void)
+{
+    pthread_mutex_lock(&mqtt.lock);
+    mqtt.done = 1;
+    pthread_cond_signal(&mqtt.cond);
+    pthread_mutex_unlock(&mqtt.lock);
+
+    pthread_join(mqtt.thread, NULL);
+}
+
+/*
+ ****************************************************************
+ *
+ * InfluxDB line protocol output.
+ *
+ ****************************************************************
+ */
+
+/*
+ * Samples can be written as InfluxDB line protocol,
+ *
+ *   serial_meter,meter=meter0,unit=Ohm value=4710,attributes=8405024i 1700000000123456789
+ *
+ * to a file ("-" for stdout) or to a "unix://path" stream socket such
+ * as a telegraf socket_listener.
+ *
+ * Everything up to the fields depends only on the meter and the
+ * unit, so it is formatted once per meter and unit up front.  The
+ * value is written straight from the sample's count and exponent, so
+ * it is exact, and the timestamp with a digit pair table rather than
+ * printf.
+ *
+ * Readers append lines to a buffer, which a writer thread flushes
+ * once INFLUX_BATCH bytes have built up or INFLUX_INTERVAL ms after
+ * the oldest unflushed line.
+ */
+#define INFLUX_MEASUREMENT	"serial_meter"
+#define INFLUX_BATCH	(64 * 1024)
+#define INFLUX_INTERVAL	1000	/* ms */
+#define INFLUX_BUFFER	(1024 * 1024)
+#define INFLUX_LINE	(64 + 32 * (FILTER_PERCENTILES + 1))
+				/* Longest line after the series prefix. */
+
+struct influx
+{
+    char *dest;			/* NULL if not writing line protocol. */
+    int fd;
+    int socket;			/* dest is a "unix://" socket. */
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *buf;			/* Lines being added by the readers, */
+    char *out;			/* and lines being written. */
+    _Atomic size_t len;
+    long long first;		/* When the oldest line in buf was added. */
+    _Atomic unsigned long dropped;
+    int done;
+    pthread_t thread;
+};
+
+struct influx influx =
+{
+    .fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+static const char digit_pairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+/*
+ * Write an unsigned number in decimal, two digits at a time.  Returns
+ * the number of characters written.
+ */
+int
+format_ulong(char* p, unsigned long long v)
+{
+    char tmp[20];
+    char *t = tmp + sizeof(tmp);
+    int len;
+
+    while (v >= 100)
+    {
+        t -= 2;
+        memcpy(t, &digit_pairs[(v % 100) * 2], 2);
+        v /= 100;
+    }
+    if (v >= 10)
+    {
+        t -= 2;
+        memcpy(t, &digit_pairs[v * 2], 2);
+    }
+    else
+        *--t = '0' + v;
+
+    len = tmp + sizeof(tmp) - t;
+    memcpy(p, t, len);
+
+    return len;
+}
+
+/*
+ * Write count * 10^exp in decimal without going through floating
+ * point, e.g. 471 and -2 as "4.71", 471 and 1 as "4710".
+ */
+int
+format_fixed(char* p, long count, int exp)
+{
+    char digits[24];
+    int ndigits;
+    int len = 0;
+    int n;
+
+    if (count < 0)
+    {
+        p[len++] = '-';
+        count = -count;
+    }
+
+    ndigits = format_ulong(digits, count);
+
+    if (exp >= 0)
+    {
+        memcpy(p + len, digits, ndigits);
+        len += ndigits;
+        for (n = 0; n < exp; n++)
+            p[len++] = '0';
+    }
+    else if (ndigits > -exp)
+    {
+        memcpy(p + len, digits, ndigits + exp);
+        len += ndigits + exp;
+        p[len++] = '.';
+        memcpy(p + len, digits + ndigits + exp, -exp);
+        len += -exp;
+    }
+    else
+    {
+        p[len++] = '0';
+        p[len++] = '.';
+        for (n = ndigits; n < -exp; n++)
+            p[len++] = '0';
+        memcpy(p + len, digits, ndigits);
+        len += ndigits;
+    }
+
+    return len;
+}
+
+/*
+ * Copy a tag value, escaping the characters line protocol cares
+ * about.
+ */
+int
+influx_escape(char* p, char* str)
+{
+    int len = 0;
+
+    for (; *str; str++)
+    {
+        if ((*str == ',') || (*str == '=') || (*str == ' '))
+            p[len++] = '\\';
+        p[len++] = *str;
+    }
+
+    return len;
+}
+
+/*
+ * Build the "measurement,tags " prefix for each unit a meter could be
+ * showing.
+ */
+void
+influx_prefixes(struct meter* m)
+{
+    char prefix[256];
+    char *unit;
+    int len;
+    int u;
+
+    m->influx_prefix = calloc(NUNITS, sizeof(char *));
+    m->influx_prefix_len = calloc(NUNITS, sizeof(int));
+
+    for (u = 0; u < NUNITS; u++)
+    {
+        len = sprintf(prefix, "%s,meter=", INFLUX_MEASUREMENT);
+        len += influx_escape(prefix + len, m->name);
+        unit = m->unit ? m->unit : unit_table[u].name;
+        if (unit[0])
+        {
+            len += sprintf(prefix + len, ",unit=");
+            len += influx_escape(prefix + len, unit);
+        }
+        prefix[len++] = ' ';
+        prefix[len] = '\0';
+
+        m->influx_prefix[u] = strdup(prefix);
+        m->influx_prefix_len[u] = len;
+    }
+}
+
+/*
+ * Add a line for an event to the buffer.  Events are rare, so this
+ * just uses printf.
+ */
+void
+influx_event(struct sample* s)
+{
+    char line[512];
+    char *unit = meter_unit(s->meter, s->attributes);
+    int len;
+
+    len = sprintf(line, "%s_events,meter=", INFLUX_MEASUREMENT);
+    len += influx_escape(line + len, s->meter->name);
+    if (unit[0])
+    {
+        len += sprintf(line + len, ",unit=");
+        len += influx_escape(line + len, unit);
+    }
+    len += sprintf(line + len, ",event=%s value=%.10g,from=%.10g,"
+        "score=%.1f,latency=%lldi %lld\n", event_names[s->event], s->value,
+        s->baseline, s->score, s->latency, s->time);
+
+    pthread_mutex_lock(&influx.lock);
+
+    if (influx.len + len > INFLUX_BUFFER)
+        influx.dropped++;
+    else
+    {
+        if (influx.len == 0)
+        {
+            influx.first = s->time;
+            pthread_cond_signal(&influx.cond);
+        }
+        memcpy(influx.buf + influx.len, line, len);
+        influx.len += len;
+    }
+
+    pthread_mutex_unlock(&influx.lock);
+}
+
+/*
+ * Add a line for a sample to the buffer.  Called by the reader
+ * threads.
+ */
+void
+influx_queue(struct sample* s)
+{
+    struct meter *m = s->meter;
+    int u = attribute_unit_index(s->attributes);
+    char *p;
+    int n;
+
+    if (s->event)
+    {
+        influx_event(s);
+        return;
+    }
+
+    pthread_mutex_lock(&influx.lock);
+
+    if (influx.len + m->influx_prefix_len[u] + INFLUX_LINE > INFLUX_BUFFER)
+    {
+        influx.dropped++;
+        pthread_mutex_unlock(&influx.lock);
+        return;
+    }
+
+    if (influx.len == 0)
+    {
+        influx.first = s->time;
+        pthread_cond_signal(&influx.cond);
+    }
+
+    p = influx.buf + influx.len;
+    memcpy(p, m->influx_prefix[u], m->influx_prefix_len[u]);
+    p += m->influx_prefix_len[u];
+
+    if (s->overload)
+    {
+        memcpy(p, "overload=true", 13);
+        p += 13;
+    }
+    else
+    {
+        memcpy(p, "value=", 6);
+        p += 6;
+        p += format_fixed(p, s->count, sample_exponent(s));
+    }
+
+    if (s->filtered)
+    {
+        p += sprintf(p, ",median=%.10g", s->median);
+        for (n = 0; n < filter.npercentiles; n++)
+            p += sprintf(p, ",p%g=%.10g", filter.percentiles[n],
+                s->percentiles[n]);
+    }
+
+    memcpy(p, ",attributes=", 12);
+    p += 12;
+    p += format_ulong(p, s->attributes);
+    *p++ = 'i';
+    *p++ = ' ';
+    p += format_ulong(p, s->time);
+    *p++ = '\n';
+
+    influx.len = p - influx.buf;
+    if (influx.len >= INFLUX_BATCH)
+        pthread_cond_signal(&influx.cond);
+
+    pthread_mutex_unlock(&influx.lock);
+}
+
+int
+influx_open(void)
+{
+    struct sockaddr_un sun;
+
+    if (strcmp(influx.dest, "-") == 0)
+    {
+        influx.fd = 1;
+        return 0;
+    }
+
+    if (strncmp(influx.dest, "unix://", 7) != 0)
+    {
+        influx.fd = open(influx.dest, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (influx.fd < 0)
+        {
+            perror(influx.dest);
+            return -1;
+        }
+        return 0;
+    }
+
+    influx.socket = 1;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strncpy(sun.sun_path, influx.dest + 7, sizeof(sun.sun_path) - 1);
+
+    influx.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(influx.fd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+    {
+        perror(influx.dest);
+        close(influx.fd);
+        influx.fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Move to another destination if a reload asked for one, from the
+ * next batch on.
+ */
+void
+influx_follow(void)
+{
+    struct config *c = config_read();
+    char *dest = NULL;
+
+    if (c && c->influx && strcmp(c->influx, influx.dest))
+        dest = strdup(c->influx);
+    config_done();
+
+    if (dest == NULL)
+        return;
+
+    printf("influx: switching to %s\n", dest);
+    if ((influx.fd >= 0) && (influx.fd != 1))
+        close(influx.fd);
+    influx.fd = -1;
+    influx.socket = 0;
+    free(influx.dest);
+    influx.dest = dest;
+    influx_open();
+}
+
+/*
+ * The writer thread.
+ */
+void*
+influx_thread(void* arg)
+{
+    struct timespec deadline;
+    long long when;
+    unsigned long dropped;
+    unsigned long reported = 0;
+    long long start;
+    size_t len;
+    char *tmp;
+
+    (void)arg;
+
+    trace_thread("influx");
+
+    pthread_mutex_lock(&influx.lock);
+    for (;;)
+    {
+        while ((influx.len == 0) && !influx.done)
+            pthread_cond_wait(&influx.cond, &influx.lock);
+
+        if ((influx.len == 0) && influx.done)
+            break;
+
+        /* Let the batch fill up, until the oldest line is too old. */
+        when = influx.first + INFLUX_INTERVAL * 1000000LL;
+        deadline.tv_sec = when / 1000000000;
+        deadline.tv_nsec = when % 1000000000;
+        while ((influx.len < INFLUX_BATCH) && !influx.done)
+        {
+            if (pthread_cond_timedwait(&influx.cond, &influx.lock, &deadline))
+                break;
+        }
+
+        tmp = influx.out;
+        influx.out = influx.buf;
+        influx.buf = tmp;
+        len = influx.len;
+        influx.len = 0;
+        dropped = influx.dropped;
+        pthread_mutex_unlock(&influx.lock);
+
+        if (dropped != reported)
+            printf("influx: dropped %lu samples\n", dropped - reported);
+        reported = dropped;
+
+        /* A socket that went away is reconnected on the next batch. */
+        influx_follow();
+        if ((influx.fd < 0) && influx.socket)
+            influx_open();
+
+        start = trace_begin();
+        if ((influx.fd >= 0) && (write_all(influx.fd, influx.out, len) < 0))
+        {
+            perror(influx.dest);
+            if (influx.socket)
+            {
+                close(influx.fd);
+                influx.fd = -1;
+            }
+        }
+        trace_end("influx_write", start, len);
+        DTRACE_PROBE2(serial_meter, influx_flush, len, influx.fd);
+
+        pthread_mutex_lock(&influx.lock);
+    }
+    pthread_mutex_unlock(&influx.lock);
+
+    return NULL;
+}
+
+/*
+ * Start writing line protocol to dest, if not already.
+ */
+int
+influx_start(char* dest)
+{
+    int n;
+
+    if (influx.buf)
+        return 0;
+
+    influx.dest = strdup(dest);
+    if (influx_open() && !influx.socket)
+        return -1;
+
+    for (n = 0; n < nmeters; n++)
+        influx_prefixes(&meters[n]);
+
+    influx.buf = malloc(INFLUX_BUFFER);
+    influx.out = malloc(INFLUX_BUFFER);
+
+    return pthread_create(&influx.thread, NULL, influx_thread, NULL);
+}
+
+void
+influx_stop(void)
+{
+    pthread_mutex_lock(&influx.lock);
+    influx.done = 1;
+    pthread_cond_signal(&influx.cond);
+    pthread_mutex_unlock(&influx.lock);
+
+    pthread_join(influx.thread, NULL);
+}
+
+/*
+ ****************************************************************
+ *
+ * Derived channels.
+ *
+ ****************************************************************
+ */
+
+/*
+ * "-d name[:unit][@ms]=expression" defines a virtual meter whose
+ * value is computed from other meters, e.g.
+ *
+ *   serial-meter -d power:W=volts*amps volts=/dev/ttyUSB0 amps=/dev/ttyUSB1
+ *
+ * Expressions use meter names (including earlier derived channels),
+ * numbers, + - * / and parentheses, and are compiled once into a
+ * small stack program.  A derived channel is recomputed, in the
+ * reader thread, whenever one of its inputs produces a sample, from
+ * the latest value of each of the others.  With "@ms" it is only
+ * computed when all of its inputs have had a sample within that many
+ * milliseconds of each other.
+ *
+ * The result is emitted like a sample from any other meter.
+ *
+ * "-I name[:unit][@ms]=expression" is the same, except that it emits
+ * the running integral over time, in seconds, of the expression, for
+ * amp-hours ("-I charge:Ah=amps/3600") or watt-hours.  It uses the
+ * trapezoidal rule on the monotonic clock.  Nothing is added across
+ * samples more than "@ms" apart (5 seconds unless given), while an
+ * input is on HOLD or showing L, or across a change of unit on an
+ * input; integration starts again from the next good sample.
+ *
+ * With "-C file", integrator totals are saved to the file every
+ * CHECKPOINT_INTERVAL seconds and on exit, and loaded from it at
+ * startup.
+ */
+#define INTEGRATE_GAP	5000	/* ms */
+#define CHECKPOINT_INTERVAL 10	/* seconds */
+#define OP_CONST	0
+#define OP_METER	1
+#define OP_ADD		2
+#define OP_SUB		3
+#define OP_MUL		4
+#define OP_DIV		5
+#define OP_NEG		6
+
+struct op
+{
+    int code;
+    int meter;			/* OP_METER */
+    double value;		/* OP_CONST */
+};
+
+struct derived
+{
+    struct meter *meter;	/* The virtual meter it appears as. */
+    struct op *ops;
+    int nops;
+    int depth;			/* Stack needed to run ops. */
+    long long window;		/* ns, or 0 to use the latest values. */
+    pthread_mutex_t lock;	/* Inputs can come from several threads. */
+
+    /* Integrators only. */
+    int integrate;
+    long long gap;		/* ns */
+    double total;
+    int have_last;		/* last_xxx can be integrated from. */
+    double last_value;
+    long long last_mono;
+    unsigned long last_units;	/* Units of the inputs. */
+};
+
+void emit_sample(struct sample* s);
+
+/*
+ * Expression compiler state.
+ */
+struct compiler
+{
+    char *p;			/* Next character. */
+    struct derived *d;
+    int nmeters;		/* Meters that may be referred to. */
+    int depth;
+    char *error;
+};
+
+void
+compile_op(struct compiler* c, int code, int meter, double value)
+{
+    struct derived *d = c->d;
+
+    d->ops = realloc(d->ops, (d->nops + 1) * sizeof(struct op));
+    d->ops[d->nops].code = code;
+    d->ops[d->nops].meter = meter;
+    d->ops[d->nops].value = value;
+    d->nops++;
+
+    if ((code == OP_CONST) || (code == OP_METER))
+    {
+        c->depth++;
+        if (c->depth > d->depth)
+            d->depth = c->depth;
+    }
+    else if (code != OP_NEG)
+        c->depth--;
+}
+
+void
+compile_space(struct compiler* c)
+{
+    while (*c->p == ' ')
+        c->p++;
+}
+
+void compile_expr(struct compiler* c);
+
+void
+compile_primary(struct compiler* c)
+{
+    char *end;
+    double value;
+    int len;
+    int n;
+
+    compile_space(c);
+
+    if (*c->p == '(')
+    {
+        c->p++;
+        compile_expr(c);
+        compile_space(c);
+        if (*c->p != ')')
+        {
+            c->error = "missing )";
+            return;
+        }
+        c->p++;
+        return;
+    }
+
+    if (*c->p == '-')
+    {
+        c->p++;
+        compile_primary(c);
+        compile_op(c, OP_NEG, 0, 0);
+        return;
+    }
+
+    /*
+     * A meter name first, as strtod() would take names like "infra" or
+     * "0x1" for numbers.
+     */
+    for (len = 0; (c->p[len] == '_') ||
+        (c->p[len] >= '0' && c->p[len] <= '9') ||
+        ((c->p[len] | 0x20) >= 'a' && (c->p[len] | 0x20) <= 'z'); len++)
+        ;
+
+    for (n = 0; n < c->nmeters; n++)
+    {
+        if ((strncmp(meters[n].name, c->p, len) == 0) &&
+            (meters[n].name[len] == '\0'))
+            break;
+    }
+
+    if ((len > 0) && (n < c->nmeters))
+    {
+        c->p += len;
+        compile_op(c, OP_METER, n, 0);
+        return;
+    }
+
+    value = strtod(c->p, &end);
+    if (end == c->p)
+    {
+        c->error = "expected a number or meter name";
+        return;
+    }
+
+    c->p = end;
+    compile_op(c, OP_CONST, 0, value);
+}
+
+void
+compile_term(struct compiler* c)
+{
+    int op;
+
+    compile_primary(c);
+    for (;;)
+    {
+        compile_space(c);
+        if ((*c->p != '*') && (*c->p != '/'))
+            return;
+
+        op = (*c->p++ == '*') ? OP_MUL : OP_DIV;
+        compile_primary(c);
+        compile_op(c, op, 0, 0);
+    }
+}
+
+void
+compile_expr(struct compiler* c)
+{
+    int op;
+
+    compile_term(c);
+    for (;;)
+    {
+        compile_space(c);
+        if ((*c->p != '+') && (*c->p != '-'))
+            return;
+
+        op = (*c->p++ == '+') ? OP_ADD : OP_SUB;
+        compile_term(c);
+        compile_op(c, op, 0, 0);
+    }
+}
+
+/*
+ * Set up a derived channel as meter number index, from its "-d"
+ * definition.  Only meters before it can be used as inputs.
+ */
+int
+derived_open(struct meter* m, char* spec, int index, int integrate)
+{
+    struct compiler c;
+    struct derived *d;
+    char *expr;
+    char *p;
+    int n;
+
+    memset(m, 0, sizeof(*m));
+    m->index = index;
+    m->source = SOURCE_DERIVED;
+    m->fd = -1;
+
+    expr = strchr(spec, '=');
+    if ((expr == NULL) || (expr == spec))
+    {
+        printf("Bad derived channel \"%s\", expected name=expression\n", spec);
+        return -1;
+    }
+
+    m->name = strndup(spec, expr - spec);
+    m->port = ++expr;
+
+    d = calloc(1, sizeof(struct derived));
+    d->meter = m;
+    pthread_mutex_init(&d->lock, NULL);
+    m->derived = d;
+
+    d->integrate = integrate;
+    d->gap = INTEGRATE_GAP * 1000000LL;
+
+    p = strchr(m->name, '@');
+    if (p)
+    {
+        *p++ = '\0';
+        if (integrate)
+            d->gap = atol(p) * 1000000LL;
+        else
+            d->window = atol(p) * 1000000LL;
+    }
+
+    p = strchr(m->name, ':');
+    if (p)
+    {
+        *p++ = '\0';
+        m->unit = p;
+    }
+
+    memset(&c, 0, sizeof(c));
+    c.p = expr;
+    c.d = d;
+    c.nmeters = index;
+
+    compile_expr(&c);
+    compile_space(&c);
+    if ((c.error == NULL) && (*c.p != '\0'))
+        c.error = "unexpected character";
+    if (c.error)
+    {
+        printf("%s: %s at \"%s\"\n", m->name, c.error, c.p);
+        return -1;
+    }
+
+    /* Tell each input that this channel depends on it. */
+    for (n = 0; n < d->nops; n++)
+    {
+        struct meter *in;
+
+        if (d->ops[n].code != OP_METER)
+            continue;
+
+        in = &meters[d->ops[n].meter];
+        in->dependents = realloc(in->dependents,
+            (in->ndependents + 1) * sizeof(struct derived *));
+        in->dependents[in->ndependents++] = d;
+    }
+
+    return 0;
+}
+
+/*
+ * Recompute a derived channel after one of its inputs produced the
+ * sample s.
+ */
+void
+derived_update(struct derived* d, struct sample* s)
+{
+    double stack[d->depth + 1];
+    struct sample out;
+    struct op *op;
+    unsigned long attributes;
+    unsigned long units = 0;
+    long long time;
+    double value;
+    int hold = 0;
+    int sp = 0;
+    int n;
+
+    pthread_mutex_lock(&d->lock);
+
+    stack[0] = 0;
+    for (n = 0; n < d->nops; n++)
+    {
+        op = &d->ops[n];
+        switch (op->code)
+        {
+        case OP_CONST:
+            stack[sp++] = op->value;
+            break;
+        case OP_METER:
+            if (meter_load_latest(&meters[op->meter], &time, &value,
+                &attributes))
+                goto out;	/* No sample yet. */
+            if (d->window && (llabs(s->time - time) > d->window))
+                goto out;	/* Not from the same moment. */
+            if (attributes & ATTR_HOLD)
+                hold = 1;
+            units = units * NUNITS + attribute_unit_index(attributes);
+            stack[sp++] = value;
+            break;
+        case OP_ADD:
+            sp--;
+            stack[sp - 1] += stack[sp];
+            break;
+        case OP_SUB:
+            sp--;
+            stack[sp - 1] -= stack[sp];
+            break;
+        case OP_MUL:
+            sp--;
+            stack[sp - 1] *= stack[sp];
+            break;
+        case OP_DIV:
+            sp--;
+            stack[sp - 1] /= stack[sp];
+            break;
+        case OP_NEG:
+            stack[sp - 1] = -stack[sp - 1];
+            break;
+        }
+    }
+
+    value = stack[0];
+
+    if (d->integrate)
+    {
+        if (hold || !isfinite(value))
+            d->have_last = 0;
+        else
+        {
+            if (d->have_last && (units == d->last_units) &&
+                (s->mono > d->last_mono) && (s->mono - d->last_mono <= d->gap))
+                d->total += (d->last_value + value) / 2 *
+                    (s->mono - d->last_mono) / 1e9;
+
+            d->have_last = 1;
+            d->last_value = value;
+            d->last_mono = s->mono;
+            d->last_units = units;
+        }
+
+        value = d->total;
+    }
+
+    memset(&out, 0, sizeof(out));
+    out.meter = d->meter;
+    out.time = s->time;
+    out.mono = s->mono;
+    sample_set_value(&out, value);
+
+    d->meter->frames++;
+    emit_sample(&out);
+
+out:
+    pthread_mutex_unlock(&d->lock);
+}
+
+/*
+ * Integrator checkpoints.
+ */
+char *checkpoint_file;
+pthread_mutex_t checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void
+checkpoint_load(void)
+{
+    FILE *f;
+    char name[256];
+    double total;
+    int n;
+
+    f = fopen(checkpoint_file, "r");
+    if (f == NULL)
+        return;		/* Nothing saved yet. */
+
+    while (fscanf(f, "%255s %lf", name, &total) == 2)
+    {
+        for (n = 0; n < nmeters; n++)
+        {
+            if (meters[n].derived && meters[n].derived->integrate &&
+                (strcmp(meters[n].name, name) == 0))
+                meters[n].derived->total = total;
+        }
+    }
+
+    fclose(f);
+}
+
+/*
+ * Write the totals to a new file and rename it over the old one, so
+ * that a crash part way through leaves the previous checkpoint.  The
+ * directory is synced too, or the rename itself could be lost.
+ */
+void
+checkpoint_save(void)
+{
+    struct derived *d;
+    char tmp[4096];
+    char *slash;
+    double total;
+    FILE *f;
+    int fd;
+    int n;
+
+    pthread_mutex_lock(&checkpoint_lock);
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", checkpoint_file);
+    f = fopen(tmp, "w");
+    if (f == NULL)
+    {
+        perror(tmp);
+        pthread_mutex_unlock(&checkpoint_lock);
+        return;
+    }
+
+    for (n = 0; n < nmeters; n++)
+    {
+        d = meters[n].derived;
+        if ((d == NULL) || !d->integrate)
+            continue;
+
+        pthread_mutex_lock(&d->lock);
+        total = d->total;
+        pthread_mutex_unlock(&d->lock);
+
+        fprintf(f, "%s %.17g\n", meters[n].name, total);
+    }
+
+    fflush(f);
+    fsync(fileno(f));
+    fclose(f);
+
+    if (rename(tmp, checkpoint_file) < 0)
+    {
+        perror(checkpoint_file);
+        pthread_mutex_unlock(&checkpoint_lock);
+        return;
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s", checkpoint_file);
+    slash = strrchr(tmp, '/');
+    if (slash == NULL)
+        strcpy(tmp, ".");
+    else if (slash == tmp)
+        tmp[1] = '\0';		/* Keep "/" for the root. */
+    else
+        *slash = '\0';
+
+    fd = open(tmp, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if ((fd < 0) || (fsync(fd) < 0))
+        perror(tmp);
+    if (fd >= 0)
+        close(fd);
+
+    pthread_mutex_unlock(&checkpoint_lock);
+}
+
+/*
+ * Save the totals periodically, and when we're told to exit.  The
+ * signals are blocked in every other thread.
+ */
+void*
+checkpoint_thread(void* arg)
+{
+    sigset_t *signals = arg;
+    struct timespec interval = { CHECKPOINT_INTERVAL, 0 };
+    int sig;
+
+    for (;;)
+    {
+        sig = sigtimedwait(signals, NULL, &interval);
+        checkpoint_save();
+        if (sig > 0)
+            exit(0);
+    }
+
+    return NULL;
+}
+
+/*
+ ****************************************************************
+ *
+ * Captures.
+ *
+ ****************************************************************
+ */
+
+/*
+ * "-w file" records every packet read from the ports, as read and
+ * before it is decoded, so that it can be replayed later with
+ * "-r file" through all the same decoding and outputs.
+ *
+ * A capture starts with a 32 byte header and the 32 byte names of
+ * its meters, followed by one fixed size 32 byte record per packet,
+ * in host byte order.  Records are appended as each meter's packets
+ * arrive, so each meter's records are in time order but the meters
+ * may be interleaved slightly out of order.
+ */
+#define CAPTURE_MAGIC	"TP4000ZC"
+#define CAPTURE_VERSION	1
+#define CAPTURE_NAME	32
+
+struct capture_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t nmeters;
+    char reserved[16];
+};
+
+struct capture_record
+{
+    int64_t time;		/* ns since the epoch */
+    int64_t mono;		/* ns on the monotonic clock */
+    uint16_t meter;
+    uint8_t packet[14];		/* One nibble per byte, as from read_packet() */
+};
+
+_Static_assert(sizeof(struct capture_header) == CAPTURE_NAME,
+    "capture header size");
+_Static_assert(sizeof(struct capture_record) == 32, "capture record size");
+
+/*
+ * A capture being replayed, mapped into memory.
+ */
+struct capture
+{
+    char *file;
+    struct capture_header *header;
+    char (*names)[CAPTURE_NAME];
+    struct capture_record *records;
+    long nrecords;
+    int first_meter;		/* Index in meters[] of its meter 0. */
+};
+
+int capture_fd = -1;
+
+/*
+ * Start a capture of the first nports meters.
+ */
+int
+capture_create(char* file, int nports)
+{
+    struct capture_header header;
+    char name[CAPTURE_NAME];
+    int n;
+
+    capture_fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (capture_fd < 0)
+    {
+        perror(file);
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    header.version = CAPTURE_VERSION;
+    header.nmeters = nports;
+    if (write_all(capture_fd, &header, sizeof(header)) < 0)
+        return -1;
+
+    for (n = 0; n < nports; n++)
+    {
+        memset(name, 0, sizeof(name));
+        strncpy(name, meters[n].name, sizeof(name) - 1);
+        if (write_all(capture_fd, name, sizeof(name)) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Record a packet.  Each record goes out in a single write to an
+ * O_APPEND file, so the reader threads don't need a lock.
+ */
+void
+capture_write(struct meter* m, unsigned char* buf, long long time,
+    long long mono)
+{
+    struct capture_record r;
+
+    memset(&r, 0, sizeof(r));
+    r.time = time;
+    r.mono = mono;
+    r.meter = m->index;
+    memcpy(r.packet, buf, sizeof(r.packet));
+
+    if (write(capture_fd, &r, sizeof(r)) != sizeof(r))
+        printf("Capture write failed\n");
+}
+
+/*
+ * Map a capture for replaying.
+ */
+struct capture*
+capture_open(char* file)
+{
+    struct capture *c;
+    struct stat st;
+    size_t start;
+    void *map;
+    int fd;
+
+    fd = open(file, O_RDONLY);
+    if ((fd < 0) || (fstat(fd, &st) < 0))
+    {
+        perror(file);
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, st.st_size ? st.st_size : 1, PROT_READ, MAP_PRIVATE,
+        fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        perror(file);
+        return NULL;
+    }
+
+    c = calloc(1, sizeof(struct capture));
+    c->file = file;
+    c->header = map;
+
+    if (((size_t)st.st_size < sizeof(struct capture_header)) ||
+        (memcmp(c->header->magic, CAPTURE_MAGIC, 8) != 0) ||
+        (c->header->version != CAPTURE_VERSION))
+    {
+        printf("%s: not a capture file\n", file);
+        goto bad;
+    }
+
+    start = (c->header->nmeters + 1) * CAPTURE_NAME;
+    if ((size_t)st.st_size < start)
+    {
+        printf("%s: truncated capture file\n", file);
+        goto bad;
+    }
+
+    c->names = (char (*)[CAPTURE_NAME])((char *)map + CAPTURE_NAME);
+    c->records = (struct capture_record *)((char *)map + start);
+    c->nrecords = (st.st_size - start) / sizeof(struct capture_record);
+
+    /* We read through each capture once per meter, in order. */
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    return c;
+
+bad:
+    munmap(map, st.st_size ? st.st_size : 1);
+    free(c);
+    return NULL;
+}
+
+/*
+ * Set up the meters of a capture being replayed, starting at meter
+ * number index.  A name already used by another capture is prefixed
+ * with the capture's position on the command line.
+ */
+void
+capture_meters(struct capture* c, int index, int number)
+{
+    struct meter *m;
+    char name[CAPTURE_NAME + 16];
+    unsigned int n;
+    int i;
+
+    c->first_meter = index;
+
+    for (n = 0; n < c->header->nmeters; n++)
+    {
+        m = &meters[index + n];
+        memset(m, 0, sizeof(*m));
+        m->source = SOURCE_CAPTURE;
+        m->fd = -1;
+        m->index = index + n;
+        m->port = c->file;
+
+        snprintf(name, sizeof(name), "%.*s", CAPTURE_NAME, c->names[n]);
+        for (i = 0; i < index + (int)n; i++)
+        {
+            if (strcmp(meters[i].name, name) == 0)
+            {
+                snprintf(name, sizeof(name), "%d:%.*s", number, CAPTURE_NAME,
+                    c->names[n]);
+                break;
+            }
+        }
+        m->name = strdup(name);
+    }
+}
+
+/*
+ ****************************************************************
+ *
+ * History.
+ *
+ ****************************************************************
+ */
+
+/*
+ * "-x dir" keeps each meter's samples in dir as three NumPy .npy
+ * files, one column each:
+ *
+ *   <meter>.time.npy		int64, ns since the epoch
+ *   <meter>.value.npy		float64, in base units, NaN for L
+ *   <meter>.attributes.npy	uint32, the attribute bits
+ *
+ * so that np.load(file, mmap_mode="r") maps them straight into
+ * arrays, without parsing or copying.  Replaying captures with "-q -x
+ * dir" turns them into history.
+ *
+ * Samples are appended to files already there.  Each one is written
+ * before the shape in the header is updated to include it, so a file
+ * can be loaded at any time and has only whole samples; the columns
+ * may differ by one sample while a sample is being added.
+ */
+#define HISTORY_HEADER	128	/* Bytes, a multiple of 64 as NumPy likes. */
+
+struct history_column
+{
+    char *suffix;
+    char *descr;
+    int size;
+} history_columns[3] =
+{
+    { "time", "<i8", 8 },
+    { "value", "<f8", 8 },
+    { "attributes", "<u4", 4 }
+};
+
+char *history_dir;
+
+/*
+ * Write the .npy header for a column of n samples.
+ */
+int
+history_header(int fd, struct history_column* c, long n)
+{
+    char header[HISTORY_HEADER];
+    int len;
+
+    memset(header, ' ', sizeof(header));
+    memcpy(header, "\x93NUMPY\x01\x00", 8);
+    header[8] = (HISTORY_HEADER - 10) & 0xFF;
+    header[9] = (HISTORY_HEADER - 10) >> 8;
+    len = snprintf(header + 10, HISTORY_HEADER - 10,
+        "{'descr': '%s', 'fortran_order': False, 'shape': (%ld,), }",
+        c->descr, n);
+    header[10 + len] = ' ';
+    header[HISTORY_HEADER - 1] = '\n';
+
+    if (pwrite(fd, header, sizeof(header), 0) != sizeof(header))
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Open a meter's columns, carrying on from what they already have.
+ */
+int
+history_open(struct meter* m)
+{
+    char file[4096];
+    struct stat st;
+    long n;
+    int i;
+
+    m->history_n = -1;
+    for (i = 0; i < 3; i++)
+    {
+        snprintf(file, sizeof(file), "%s/%s.%s.npy", history_dir, m->name,
+            history_columns[i].suffix);
+        m->history_fd[i] = open(file, O_RDWR | O_CREAT, 0644);
+        if ((m->history_fd[i] < 0) || fstat(m->history_fd[i], &st))
+        {
+            perror(file);
+            return -1;
+        }
+
+        n = 0;
+        if (st.st_size > HISTORY_HEADER)
+            n = (st.st_size - HISTORY_HEADER) / history_columns[i].size;
+
+        /* Start from the shortest, if a sample was cut short. */
+        if ((m->history_n < 0) || (n < m->history_n))
+            m->history_n = n;
+    }
+
+    for (i = 0; i < 3; i++)
+    {
+        if (history_header(m->history_fd[i], &history_columns[i],
+            m->history_n))
+        {
+            perror(history_dir);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int
+history_start(char* dir)
+{
+    int n;
+
+    history_dir = dir;
+    if ((mkdir(dir, 0755) < 0) && (errno != EEXIST))
+    {
+        perror(dir);
+        return -1;
+    }
+
+    for (n = 0; n < nmeters; n++)
+    {
+        if (history_open(&meters[n]))
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Add a sample to its meter's history.  Only the thread producing
+ * the meter's samples calls this.
+ */
+void
+history_append(struct sample* s)
+{
+    struct meter *m = s->meter;
+    uint32_t attributes = s->attributes;
+    off_t off;
+    void *data[3];
+    int i;
+
+    data[0] = &s->time;
+    data[1] = &s->value;
+    data[2] = &attributes;
+
+    for (i = 0; i < 3; i++)
+    {
+        off = HISTORY_HEADER + (off_t)m->history_n * history_columns[i].size;
+        if (pwrite(m->history_fd[i], data[i], history_columns[i].size, off) !=
+            history_columns[i].size)
+        {
+            perror(m->name);
+            return;
+        }
+    }
+
+    m->history_n++;
+    for (i = 0; i < 3; i++)
+        history_header(m->history_fd[i], &history_columns[i], m->history_n);
+}
+
+/*
+ ****************************************************************
+ *
+ * Downsampling.
+ *
+ ****************************************************************
+ */
+
+/*
+ * A month of samples is far more than a plot can show, so
+ * "serial-meter downsample" and the HTTP server's /history cut a
+ * series down to a given number of points with Largest Triangle Three
+ * Buckets, which keeps the shape and the spikes that averaging or
+ * taking every nth point would lose.
+ *
+ * The first and last points are kept, and the time in between is
+ * split into equal buckets.  One point is kept from each bucket: the
+ * one making the largest triangle with the point kept from the bucket
+ * before and the average of the bucket after.  That is done as the
+ * samples stream past, holding only two buckets, so the series never
+ * has to be in memory all at once.  Buckets with no samples are
+ * skipped, and so are samples showing L.
+ */
+#define LTTB_POINTS	1000
+
+struct lttb_point
+{
+    long long time;
+    double value;
+};
+
+struct lttb
+{
+    long long start;		/* The time covered. */
+    long long end;
+    long buckets;
+    long bucket;		/* The bucket being filled. */
+    long n;			/* Samples so far. */
+    struct lttb_point last;	/* The point last kept. */
+    struct lttb_point *held;	/* The bucket before, to choose from. */
+    long nheld;
+    long heldsize;
+    struct lttb_point *fill;
+    long nfill;
+    long fillsize;
+    void (*emit)(void* arg, long long time, double value);
+    void *arg;
+};
+
+void
+lttb_init(struct lttb* l, long long start, long long end, long points,
+    void (*emit)(void* arg, long long time, double value), void* arg)
+{
+    memset(l, 0, sizeof(*l));
+    l->start = start;
+    l->end = end;
+    l->buckets = (points > 3) ? points - 2 : 1;
+    l->emit = emit;
+    l->arg = arg;
+}
+
+/*
+ * Keep the point from the held bucket that makes the largest triangle
+ * with the last point kept and c.
+ */
+void
+lttb_choose(struct lttb* l, double ct, double cv)
+{
+    struct lttb_point *best = NULL;
+    double at = (l->last.time - l->start) / 1e9;
+    double av = l->last.value;
+    double area;
+    double max = -1;
+    long n;
+
+    for (n = 0; n < l->nheld; n++)
+    {
+        area = fabs((at - ct) * (l->held[n].value - av) -
+            (at - (l->held[n].time - l->start) / 1e9) * (cv - av));
+        if (area > max)
+        {
+            max = area;
+            best = &l->held[n];
+        }
+    }
+
+    if (best)
+    {
+        l->last = *best;
+        l->emit(l->arg, best->time, best->value);
+    }
+    l->nheld = 0;
+}
+
+/*
+ * Choose from the held bucket using the average of the one filled.
+ */
+void
+lttb_next(struct lttb* l)
+{
+    struct lttb_point *swap;
+    double t = 0;
+    double v = 0;
+    long size;
+    long n;
+
+    for (n = 0; n < l->nfill; n++)
+    {
+        t += (l->fill[n].time - l->start) / 1e9;
+        v += l->fill[n].value;
+    }
+    lttb_choose(l, t / l->nfill, v / l->nfill);
+
+    swap = l->held;
+    l->held = l->fill;
+    l->fill = swap;
+    size = l->heldsize;
+    l->heldsize = l->fillsize;
+    l->fillsize = size;
+    l->nheld = l->nfill;
+    l->nfill = 0;
+}
+
+void
+lttb_push(struct lttb* l, long long time, double value)
+{
+    long bucket;
+
+    if (isnan(value))
+        return;
+
+    if (l->n++ == 0)
+    {
+        l->last.time = time;
+        l->last.value = value;
+        l->emit(l->arg, time, value);
+        return;
+    }
+
+    bucket = 0;
+    if (l->end > l->start)
+        bucket = (double)(time - l->start) / (l->end - l->start) * l->buckets;
+    if (bucket >= l->buckets)
+        bucket = l->buckets - 1;
+    if (bucket < l->bucket)
+        bucket = l->bucket;
+
+    if ((bucket != l->bucket) && l->nfill)
+        lttb_next(l);
+    l->bucket = bucket;
+
+    if (l->nfill == l->fillsize)
+    {
+        l->fillsize = l->fillsize ? l->fillsize * 2 : 256;
+        l->fill = realloc(l->fill, l->fillsize * sizeof(struct lttb_point));
+    }
+    l->fill[l->nfill].time = time;
+    l->fill[l->nfill].value = value;
+    l->nfill++;
+}
+
+/*
+ * Finish with the last buckets and the last point.
+ */
+void
+lttb_finish(struct lttb* l)
+{
+    struct lttb_point end;
+
+    if (l->n > 1)
+    {
+        end = l->fill[--l->nfill];
+        if (l->nfill)
+            lttb_next(l);
+        lttb_choose(l, (end.time - l->start) / 1e9, end.value);
+        l->emit(l->arg, end.time, end.value);
+    }
+
+    free(l->held);
+    free(l->fill);
+    l->held = l->fill = NULL;
+}
+
+/*
+ * Map the time and value columns of a meter's history, as far as
+ * both have got.  Returns the number of samples, or -1.
+ */
+long
+history_map(char* dir, char* name, int64_t** time, double** value)
+{
+    char file[4096];
+    struct stat st;
+    void *map[2];
+    long n = -1;
+    int fd[2];
+    int i;
+
+    for (i = 0; i < 2; i++)
+    {
+        snprintf(file, sizeof(file), "%s/%s.%s.npy", dir, name,
+            history_columns[i].suffix);
+        fd[i] = open(file, O_RDONLY);
+        if ((fd[i] < 0) || fstat(fd[i], &st) ||
+            (st.st_size < HISTORY_HEADER))
+        {
+            if (fd[i] >= 0)
+                close(fd[i]);
+            if (i)
+                close(fd[0]);
+            return -1;
+        }
+
+        if ((n < 0) || ((st.st_size - HISTORY_HEADER) / 8 < n))
+            n = (st.st_size - HISTORY_HEADER) / 8;
+    }
+
+    for (i = 0; i < 2; i++)
+    {
+        map[i] = mmap(NULL, HISTORY_HEADER + n * 8, PROT_READ, MAP_SHARED,
+            fd[i], 0);
+        close(fd[i]);
+    }
+
+    if ((map[0] == MAP_FAILED) || (map[1] == MAP_FAILED))
+    {
+        for (i = 0; i < 2; i++)
+        {
+            if (map[i] != MAP_FAILED)
+                munmap(map[i], HISTORY_HEADER + n * 8);
+        }
+        return -1;
+    }
+
+    *time = (int64_t *)((char *)map[0] + HISTORY_HEADER);
+    *value = (double *)((char *)map[1] + HISTORY_HEADER);
+
+    return n;
+}
+
+void
+history_unmap(int64_t* time, double* value, long n)
+{
+    munmap((char *)time - HISTORY_HEADER, HISTORY_HEADER + n * 8);
+    munmap((char *)value - HISTORY_HEADER, HISTORY_HEADER + n * 8);
+}
+
+/*
+ * Downsample a meter's history, from the time since on.
+ */
+int
+history_downsample(char* dir, char* name, long long since, long points,
+    void (*emit)(void* arg, long long time, double value), void* arg)
+{
+    struct lttb l;
+    int64_t *time;
+    double *value;
+    long first;
+    long n;
+    long i;
+
+    n = history_map(dir, name, &time, &value);
+    if (n < 0)
+        return -1;
+
+    /* The history is in time order, so find the start by bisection. */
+    first = 0;
+    for (i = n; i > first; )
+    {
+        if (time[(first + i) / 2] < since)
+            first = (first + i) / 2 + 1;
+        else
+            i = (first + i) / 2;
+    }
+
+    if (first < n)
+    {
+        lttb_init(&l, time[first], time[n - 1], points, emit, arg);
+        for (i = first; i < n; i++)
+            lttb_push(&l, time[i], value[i]);
+        lttb_finish(&l);
+    }
+
+    history_unmap(time, value, n);
+
+    return 0;
+}
+
+void
+downsample_print(void* arg, long long time, double value)
+{
+    printf("%s,%lld.%09lld,%.10g\n", (char *)arg, time / 1000000000LL,
+        time % 1000000000LL, value);
+}
+
+/*
+ * Downsample a meter from the captures it's in.
+ */
+void
+downsample_capture(struct capture* c, struct meter* m, long points)
+{
+    struct capture_record *r;
+    struct sample sample;
+    struct lttb l;
+    long first;
+    long last;
+    long n;
+    int meter = m->index - c->first_meter;
+
+    for (first = 0; first < c->nrecords; first++)
+    {
+        if (c->records[first].meter == meter)
+            break;
+    }
+    for (last = c->nrecords - 1; last > first; last--)
+    {
+        if (c->records[last].meter == meter)
+            break;
+    }
+    if (first == c->nrecords)
+        return;
+
+    lttb_init(&l, c->records[first].time, c->records[last].time, points,
+        downsample_print, m->name);
+    for (n = first; n <= last; n++)
+    {
+        r = &c->records[n];
+        if ((r->meter == meter) &&
+            (meter_decode(m, r->packet, r->time, r->mono, &sample) == 0))
+            lttb_push(&l, r->time, sample.value);
+    }
+    lttb_finish(&l);
+}
+
+int
+downsample_main(int argc, char** argv)
+{
+    struct capture *c;
+    struct dirent *d;
+    struct stat st;
+    char *only = NULL;
+    char *suffix;
+    long points = LTTB_POINTS;
+    DIR *dir;
+    int index = 0;
+    int n;
+    int i;
+
+    while ((n = getopt(argc, argv, "n:m:")) != -1)
+    {
+        switch (n)
+        {
+        case 'n':
+            points = atol(optarg);
+            break;
+        case 'm':
+            only = optarg;
+            break;
+        default:
+            points = 0;
+        }
+    }
+
+    if ((points < 3) || (optind >= argc))
+    {
+        printf("Usage: serial-meter downsample [-n points] [-m meter] "
+            "capture|dir ...\n");
+        return 1;
+    }
+
+    printf("meter,time,value\n");
+
+    for (i = optind; i < argc; i++)
+    {
+        if ((stat(argv[i], &st) == 0) && S_ISDIR(st.st_mode))
+        {
+            /* A history directory, with a .time.npy file per meter. */
+            dir = opendir(argv[i]);
+            if (dir == NULL)
+            {
+                perror(argv[i]);
+                return 1;
+            }
+            while ((d = readdir(dir)) != NULL)
+            {
+                suffix = strstr(d->d_name, ".time.npy");
+                if ((suffix == NULL) || (suffix[9] != '\0'))
+                    continue;
+                *suffix = '\0';
+                if (only && (strcmp(d->d_name, only) != 0))
+                    continue;
+                if (history_downsample(argv[i], d->d_name, 0, points,
+                    downsample_print, d->d_name) < 0)
+                    printf("%s: can't read the history of %s\n", argv[i],
+                        d->d_name);
+            }
+            closedir(dir);
+            continue;
+        }
+
+        c = capture_open(argv[i]);
+        if (c == NULL)
+            return 1;
+
+        meters = realloc(meters, (index + c->header->nmeters) *
+            sizeof(struct meter));
+        capture_meters(c, index, i - optind + 1);
+        for (n = 0; n < (int)c->header->nmeters; n++)
+        {
+            if ((only == NULL) || (strcmp(meters[index + n].name, only) == 0))
+                downsample_capture(c, &meters[index + n], points);
+        }
+        index += c->header->nmeters;
+        nmeters = index;
+    }
+
+    return 0;
+}
+
+/*
+ ****************************************************************
+ *
+ * Merging.
+ *
+ ****************************************************************
+ */
+
+/*
+ * Samples from several meters, or several captures, can be merged
+ * into a single stream in time order.
+ *
+ * Replaying ("-r") always merges.  Each meter in each capture is a
+ * stream of samples in time order, and a heap of the streams keyed
+ * on the time of their next sample gives the next sample overall.
+ *
+ * Live ("-M ms"), each meter's reader thread queues its samples
+ * instead of emitting them, and a merge thread emits them through
+ * the same kind of heap.  It only takes the oldest sample once every
+ * meter has something queued, or once that sample is "ms" old, so a
+ * sample is held back for at most that long and anything that comes
+ * in later than that is emitted out of order (and counted as late).
+ *
+ * "-g ms" resamples the merged stream onto a grid: every "ms" it
+ * emits the latest sample from each meter, as of that moment, with
+ * the grid time.  Meters that haven't had a sample for RESAMPLE_STALE
+ * grid steps are left out.
+ */
+#define MERGE_QUEUE	1024	/* Samples queued per meter. */
+#define MERGE_DELAY	2000	/* ms, when resampling live without -M */
+#define RESAMPLE_STALE	10
+
+/*
+ * A binary heap of stream numbers, ordered on key[stream].
+ */
+struct heap
+{
+    int *item;
+    int n;
+    long long *key;
+};
+
+void
+heap_init(struct heap* h, int size)
+{
+    h->item = calloc(size, sizeof(int));
+    h->key = calloc(size, sizeof(long long));
+    h->n = 0;
+}
+
+void
+heap_push(struct heap* h, int stream)
+{
+    int i = h->n++;
+    int parent;
+
+    while (i > 0)
+    {
+        parent = (i - 1) / 2;
+        if (h->key[h->item[parent]] <= h->key[stream])
+            break;
+        h->item[i] = h->item[parent];
+        i = parent;
+    }
+    h->item[i] = stream;
+}
+
+int
+heap_pop(struct heap* h)
+{
+    int top = h->item[0];
+    int last = h->item[--h->n];
+    int i = 0;
+    int child;
+
+    for (;;)
+    {
+        child = 2 * i + 1;
+        if (child >= h->n)
+            break;
+        if ((child + 1 < h->n) &&
+            (h->key[h->item[child + 1]] < h->key[h->item[child]]))
+            child++;
+        if (h->key[last] <= h->key[h->item[child]])
+            break;
+        h->item[i] = h->item[child];
+        i = child;
+    }
+    h->item[i] = last;
+
+    return top;
+}
+
+struct merge
+{
+    long long delay;		/* ns, 0 if not merging live. */
+    long long grid;		/* ns, 0 if not resampling. */
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct heap heap;		/* Meters with samples queued. */
+    struct sample *queue;	/* MERGE_QUEUE per meter. */
+    int *head;
+    int *count;
+    int empty;			/* Live meters with nothing queued. */
+    long long last;		/* Time of the last sample out. */
+    _Atomic unsigned long late;
+    int done;
+    pthread_t thread;
+
+    /* Resampling. */
+    long long tick;		/* Next grid time. */
+    struct sample *held;	/* Latest sample from each meter. */
+};
+
+struct merge merge =
+{
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+/*
+ * Take the merged stream, resampling it if asked to.
+ */
+void
+merge_output(struct sample* s)
+{
+    struct sample out;
+    int emitted;
+    int n;
+
+    if (s->time < merge.last)
+        merge.late++;
+    else
+        merge.last = s->time;
+
+    if (merge.grid == 0)
+    {
+        emit_sample(s);
+        return;
+    }
+
+    if (merge.tick == 0)
+        merge.tick = (s->time + merge.grid - 1) / merge.grid * merge.grid;
+
+    while (merge.tick < s->time)
+    {
+        emitted = 0;
+        for (n = 0; n < nmeters; n++)
+        {
+            if ((merge.held[n].meter == NULL) ||
+                (merge.tick - merge.held[n].time >
+                 RESAMPLE_STALE * merge.grid))
+                continue;
+
+            out = merge.held[n];
+            out.mono += merge.tick - out.time;
+            out.time = merge.tick;
+            emit_sample(&out);
+            emitted = 1;
+        }
+
+        /* Skip over stretches where nothing is happening. */
+        if (!emitted)
+            merge.tick = (s->time + merge.grid - 1) / merge.grid * merge.grid;
+        else
+            merge.tick += merge.grid;
+    }
+
+    merge.held[s->meter->index] = *s;
+}
+
+/*
+ * Queue a sample for the merge thread.  Called by the reader threads.
+ */
+void
+merge_push(struct sample* s)
+{
+    int m = s->meter->index;
+
+    pthread_mutex_lock(&merge.lock);
+
+    if (merge.count[m] == MERGE_QUEUE)
+    {
+        /* Stuck behind a silent meter for a long time; lose one. */
+        merge.head[m] = (merge.head[m] + 1) % MERGE_QUEUE;
+        merge.count[m]--;
+    }
+
+    merge.queue[m * MERGE_QUEUE + (merge.head[m] + merge.count[m]) %
+        MERGE_QUEUE] = *s;
+    merge.count[m]++;
+
+    if (merge.count[m] == 1)
+    {
+        merge.heap.key[m] = s->time;
+        heap_push(&merge.heap, m);
+        merge.empty--;
+        pthread_cond_signal(&merge.cond);
+    }
+
+    pthread_mutex_unlock(&merge.lock);
+}
+
+void*
+merge_thread(void* arg)
+{
+    struct timespec deadline;
+    struct sample s;
+    long long when;
+    long long start;
+    int m;
+
+    (void)arg;
+
+    trace_thread("merge");
+
+    pthread_mutex_lock(&merge.lock);
+    for (;;)
+    {
+        if (merge.heap.n == 0)
+        {
+            if (merge.done)
+                break;
+            pthread_cond_wait(&merge.cond, &merge.lock);
+            continue;
+        }
+
+        /* Wait for the quiet meters, but not for too long. */
+        m = merge.heap.item[0];
+        if (merge.empty && !merge.done)
+        {
+            when = merge.heap.key[m] + merge.delay;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            if (deadline.tv_sec * 1000000000LL + deadline.tv_nsec < when)
+            {
+                deadline.tv_sec = when / 1000000000;
+                deadline.tv_nsec = when % 1000000000;
+                pthread_cond_timedwait(&merge.cond, &merge.lock, &deadline);
+                continue;
+            }
+        }
+
+        heap_pop(&merge.heap);
+        s = merge.queue[m * MERGE_QUEUE + merge.head[m]];
+        merge.head[m] = (merge.head[m] + 1) % MERGE_QUEUE;
+        merge.count[m]--;
+
+        if (merge.count[m])
+        {
+            merge.heap.key[m] =
+                merge.queue[m * MERGE_QUEUE + merge.head[m]].time;
+            heap_push(&merge.heap, m);
+        }
+        else
+            merge.empty++;
+
+        pthread_mutex_unlock(&merge.lock);
+        start = trace_begin();
+        merge_output(&s);
+        trace_end("output", start, s.meter->frames);
+        pthread_mutex_lock(&merge.lock);
+    }
+    pthread_mutex_unlock(&merge.lock);
+
+    return NULL;
+}
+
+void
+merge_init(int nlive)
+{
+    if (merge.grid)
+        merge.held = calloc(nmeters, sizeof(struct sample));
+
+    if (merge.delay == 0)
+        return;
+
+    heap_init(&merge.heap, nmeters);
+    merge.queue = calloc(nmeters * MERGE_QUEUE, sizeof(struct sample));
+    merge.head = calloc(nmeters, sizeof(int));
+    merge.count = calloc(nmeters, sizeof(int));
+    merge.empty = nlive;
+
+    pthread_create(&merge.thread, NULL, merge_thread, NULL);
+}
+
+void
+merge_stop(void)
+{
+    pthread_mutex_lock(&merge.lock);
+    merge.done = 1;
+    pthread_cond_signal(&merge.cond);
+    pthread_mutex_unlock(&merge.lock);
+
+    pthread_join(merge.thread, NULL);
+}
+
+/*
+ * Move a replay stream on to the next record for its meter.  Returns
+ * 0 at the end of the capture.
+ */
+int
+replay_next(struct capture* c, int meter, long* pos)
+{
+    do
+        (*pos)++;
+    while ((*pos < c->nrecords) && (c->records[*pos].meter != meter));
+
+    return *pos < c->nrecords;
+}
+
+/*
+ * Replay captures, merging all of their meters into time order.
+ */
+void
+replay(struct capture** captures, int ncaptures)
+{
+    struct capture **owner;
+    struct heap heap;
+    struct sample s;
+    struct capture *c;
+    struct capture_record *r;
+    long long start;
+    long *pos;
+    int stream;
+    int meter;
+    int i;
+    int n;
+
+    /* There is a stream for each meter, numbered like meters[]. */
+    heap_init(&heap, nmeters);
+    pos = calloc(nmeters, sizeof(long));
+    owner = calloc(nmeters, sizeof(struct capture *));
+
+    for (i = 0; i < ncaptures; i++)
+    {
+        c = captures[i];
+        for (meter = 0; meter < (int)c->header->nmeters; meter++)
+        {
+            stream = c->first_meter + meter;
+            owner[stream] = c;
+            pos[stream] = -1;
+
+            if (replay_next(c, meter, &pos[stream]))
+            {
+                heap.key[stream] = c->records[pos[stream]].time;
+                heap_push(&heap, stream);
+            }
+        }
+    }
+
+    while (heap.n)
+    {
+        stream = heap_pop(&heap);
+        c = owner[stream];
+        meter = stream - c->first_meter;
+        r = &c->records[pos[stream]];
+
+        meters[stream].frames++;
+        start = trace_begin();
+        n = meter_decode(&meters[stream], r->packet, r->time, r->mono, &s);
+        trace_end("decode", start, meters[stream].frames);
+        if (n == 0)
+        {
+            start = trace_begin();
+            merge_output(&s);
+            trace_end("output", start, meters[stream].frames);
+        }
+
+        if (replay_next(c, meter, &pos[stream]))
+        {
+            heap.key[stream] = c->records[pos[stream]].time;
+            heap_push(&heap, stream);
+        }
+    }
+}
+
+/*
+ ****************************************************************
+ *
+ * HTTP server.
+ *
+ ****************************************************************
+ */
+
+/*
+ * "-H [addr:]port" serves the latest reading from each meter and the
+ * reader and output counters as OpenMetrics text on /metrics, and a
+ * live stream of samples as server-sent events on /events.  It
+ * listens on the loopback address unless told otherwise.
+ *
+ * The server is one thread polling non-blocking sockets.  It never
+ * takes a lock the reader threads use: counters are atomic, and the
+ * latest sample is published under a sequence lock which the reader
+ * only ever writes.
+ */
+#define HTTP_ADDRESS	"127.0.0.1"
+#define HTTP_CLIENTS	1024
+#define HTTP_REQUEST	2048	/* Longest request header we accept. */
+
+/*
+ * A growing text buffer.
+ */
+struct buf
+{
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+void
+buf_reserve(struct buf* b, size_t len)
+{
+    if (b->len + len + 1 <= b->size)
+        return;
+
+    while (b->len + len + 1 > b->size)
+        b->size = b->size ? b->size * 2 : 4096;
+    b->data = realloc(b->data, b->size);
+}
+
+void
+buf_append(struct buf* b, const char* str, size_t len)
+{
+    buf_reserve(b, len);
+    memcpy(b->data + b->len, str, len);
+    b->len += len;
+    b->data[b->len] = '\0';
+}
+
+void
+buf_printf(struct buf* b, const char* fmt, ...)
+{
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+
+    buf_reserve(b, len);
+
+    va_start(ap, fmt);
+    vsnprintf(b->data + b->len, len + 1, fmt, ap);
+    va_end(ap);
+
+    b->len += len;
+}
+
+/*
+ * "/events" sends every sample to the browser as a server-sent event,
+ * and "/events?changes" only those where the display or attributes
+ * changed.
+ *
+ * Each sample is formatted once, by its reader thread, into a shared
+ * ring for each of the two streams.  A client only remembers how far
+ * along the stream it has got and is sent straight from the ring, so
+ * a sample costs the same however many dashboards are watching.
+ *
+ * Readers append to a ring under a lock that only they share, then
+ * publish the new head.  The HTTP thread reads behind the head
+ * without locking, and drops any client that falls more than half a
+ * ring behind rather than let it be overwritten.
+ */
+#define SSE_RING	(1024 * 1024)
+#define SSE_ALL		0
+#define SSE_CHANGES	1
+
+struct sse_stream
+{
+    pthread_mutex_t lock;
+    char *ring;
+    _Atomic unsigned long long head;	/* Bytes ever written. */
+};
+
+struct sse_stream sse[2] =
+{
+    { .lock = PTHREAD_MUTEX_INITIALIZER },
+    { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+
+struct http_client
+{
+    int fd;			/* -1 if the slot is free. */
+    char req[HTTP_REQUEST];
+    int reqlen;
+    struct buf out;		/* Response being sent, */
+    size_t outpos;		/* and how much of it has gone. */
+    struct sse_stream *stream;	/* Event stream being followed, */
+    unsigned long long pos;	/* and how much of it has gone. */
+    char *query;		/* Of a /history request, */
+    _Atomic int busy;		/* while a thread builds the response. */
+};
+
+struct http
+{
+    char *listen;		/* NULL if not serving. */
+    int fd;
+    struct http_client *clients;
+    int wake[2];		/* Pipe to wake up the server for events. */
+    _Atomic int wake_pending;
+    _Atomic int histories;	/* /history threads running. */
+    pthread_t thread;
+};
+
+struct http http =
+{
+    .fd = -1
+};
+
+/*
+ * Write a label value, escaped for OpenMetrics.
+ */
+void
+metrics_label(struct buf* b, char* str)
+{
+    for (; *str; str++)
+    {
+        if ((*str == '\\') || (*str == '"'))
+            buf_append(b, "\\", 1);
+        if (*str == '\n')
+            buf_append(b, "\\n", 2);
+        else
+            buf_append(b, str, 1);
+    }
+}
+
+/*
+ * The per-meter counters, by their offset in struct meter.
+ */
+struct meter_counter
+{
+    char *name;
+    char *help;
+    size_t offset;
+} meter_counters[] =
+{
+    { "frames", "Packets read.",
+        offsetof(struct meter, frames) },
+    { "resyncs", "Partial or bad packets dropped.",
+        offsetof(struct meter, resyncs) },
+    { "invalid_bytes", "Bytes with an invalid position.",
+        offsetof(struct meter, invalid_bytes) },
+    { "decode_failures", "Packets with digits that couldn't be decoded.",
+        offsetof(struct meter, decode_failures) },
+    { "reconnects", "Device server connections lost.",
+        offsetof(struct meter, reconnects) },
+    { "spikes", "Readings far from the recent mean.",
+        offsetof(struct meter, spikes) },
+    { "steps", "Steps up or down in the readings.",
+        offsetof(struct meter, steps) },
+    { NULL, NULL, 0 }
+};
+
+void
+metrics_render(struct buf* b)
+{
+    struct meter_counter *c;
+    struct meter *m;
+    _Atomic unsigned long *counter;
+    unsigned long attributes;
+    long long time;
+    double value;
+    int n;
+
+    buf_printf(b, "# TYPE serial_meter_value gauge\n"
+        "# HELP serial_meter_value Latest reading, in base units.\n");
+    for (n = 0; n < nmeters; n++)
+    {
+        m = &meters[n];
+        if (meter_load_latest(m, &time, &value, &attributes))
+            continue;
+
+        buf_printf(b, "serial_meter_value{meter=\"");
+        metrics_label(b, m->name);
+        buf_printf(b, "\",unit=\"%s\"} ", meter_unit(m, attributes));
+        if (isnan(value))
+            buf_printf(b, "NaN\n");
+        else
+            buf_printf(b, "%.10g\n", value);
+    }
+
+    buf_printf(b, "# TYPE serial_meter_attributes gauge\n"
+        "# HELP serial_meter_attributes Latest attribute bits.\n");
+    for (n = 0; n < nmeters; n++)
+    {
+        m = &meters[n];
+        if (meter_load_latest(m, &time, &value, &attributes))
+            continue;
+
+        buf_printf(b, "serial_meter_attributes{meter=\"");
+        metrics_label(b, m->name);
+        buf_printf(b, "\"} %lu\n", attributes);
+    }
+
+    buf_printf(b, "# TYPE serial_meter_last_sample_timestamp_seconds gauge\n"
+        "# HELP serial_meter_last_sample_timestamp_seconds "
+        "When the latest packet ended.\n");
+    for (n = 0; n < nmeters; n++)
+    {
+        m = &meters[n];
+        if (meter_load_latest(m, &time, &value, &attributes))
+            continue;
+
+        buf_printf(b, "serial_meter_last_sample_timestamp_seconds{meter=\"");
+        metrics_label(b, m->name);
+        buf_printf(b, "\"} %lld.%09lld\n",
+            time / 1000000000, time % 1000000000);
+    }
+
+    for (c = meter_counters; c->name != NULL; c++)
+    {
+        buf_printf(b, "# TYPE serial_meter_%s counter\n"
+            "# HELP serial_meter_%s %s\n", c->name, c->name, c->help);
+        for (n = 0; n < nmeters; n++)
+        {
+            m = &meters[n];
+            counter = (_Atomic unsigned long *)((char *)m + c->offset);
+
+            buf_printf(b, "serial_meter_%s_total{meter=\"", c->name);
+            metrics_label(b, m->name);
+            buf_printf(b, "\"} %lu\n", *counter);
+        }
+    }
+
+    buf_printf(b, "# TYPE serial_meter_step_latency_seconds counter\n"
+        "# HELP serial_meter_step_latency_seconds "
+        "Time from the start of each step to when it was reported.\n");
+    for (n = 0; n < nmeters; n++)
+    {
+        m = &meters[n];
+
+        buf_printf(b, "serial_meter_step_latency_seconds_total{meter=\"");
+        metrics_label(b, m->name);
+        buf_printf(b, "\"} %.3f\n", m->step_latency / 1e9);
+    }
+
+    if (mqtt.host)
+    {
+        buf_printf(b, "# TYPE serial_meter_mqtt_queue_samples gauge\n"
+            "# HELP serial_meter_mqtt_queue_samples "
+            "Samples waiting to be published.\n"
+            "serial_meter_mqtt_queue_samples %lu\n",
+            mqtt.head - mqtt.tail);
+    }
+
+    if (influx.dest)
+    {
+        buf_printf(b, "# TYPE serial_meter_influx_buffer_bytes gauge\n"
+            "# HELP serial_meter_influx_buffer_bytes "
+            "Line protocol waiting to be written.\n"
+            "serial_meter_influx_buffer_bytes %zu\n",
+            (size_t)influx.len);
+    }
+
+    if (mqtt.host || influx.dest)
+    {
+        buf_printf(b, "# TYPE serial_meter_dropped_samples counter\n"
+            "# HELP serial_meter_dropped_samples "
+            "Samples an output had no room for.\n");
+        if (mqtt.host)
+            buf_printf(b, "serial_meter_dropped_samples_total"
+                "{output=\"mqtt\"} %lu\n", (unsigned long)mqtt.dropped);
+        if (influx.dest)
+            buf_printf(b, "serial_meter_dropped_samples_total"
+                "{output=\"influx\"} %lu\n", (unsigned long)influx.dropped);
+    }
+
+    if (merge.delay)
+    {
+        buf_printf(b, "# TYPE serial_meter_merge_late_samples counter\n"
+            "# HELP serial_meter_merge_late_samples "
+            "Samples that arrived after the merge delay.\n"
+            "serial_meter_merge_late_samples_total %lu\n",
+            (unsigned long)merge.late);
+    }
+
+    buf_printf(b, "# EOF\n");
+}
+
+/*
+ * Wake the server to look at the clients again.
+ */
+void
+http_wake(void)
+{
+    if (!atomic_exchange(&http.wake_pending, 1))
+    {
+        if (write(http.wake[1], "", 1) < 0)
+            http.wake_pending = 0;
+    }
+}
+
+/*
+ * Add an event to a stream.  Called by the reader threads.
+ */
+void
+sse_append(struct sse_stream* stream, char* event, int len)
+{
+    unsigned long long head;
+    int off;
+    int part;
+
+    pthread_mutex_lock(&stream->lock);
+
+    head = atomic_load_explicit(&stream->head, memory_order_relaxed);
+    off = head % SSE_RING;
+    part = SSE_RING - off;
+    if (part > len)
+        part = len;
+    memcpy(stream->ring + off, event, part);
+    memcpy(stream->ring, event + part, len - part);
+    atomic_store_explicit(&stream->head, head + len, memory_order_release);
+
+    pthread_mutex_unlock(&stream->lock);
+
+    http_wake();
+}
+
+void
+sse_queue(struct sample* s)
+{
+    struct meter *m = s->meter;
+    char event[SAMPLE_JSON + 32];
+    int len;
+
+    len = sprintf(event, "event: %s\ndata: ", s->event ? "change" : "sample");
+    len += sample_json(event + len, s, m->name);
+    len += sprintf(event + len, "\n\n");
+
+    sse_append(&sse[SSE_ALL], event, len);
+
+    if (s->event)
+    {
+        sse_append(&sse[SSE_CHANGES], event, len);
+        return;
+    }
+
+    if (m->sse_seen && (s->attributes == m->sse_attributes) &&
+        (strcmp(s->display, m->sse_display) == 0))
+        return;
+
+    m->sse_seen = 1;
+    m->sse_attributes = s->attributes;
+    strcpy(m->sse_display, s->display);
+
+    sse_append(&sse[SSE_CHANGES], event, len);
+}
+
+void
+http_close(struct http_client* c)
+{
+    close(c->fd);
+    c->fd = -1;
+    c->reqlen = 0;
+    c->out.len = 0;
+    c->outpos = 0;
+    c->stream = NULL;
+}
+
+/*
+ * Queue a complete response.
+ */
+void
+http_respond(struct http_client* c, char* status, char* type,
+    char* body, size_t len)
+{
+    buf_printf(&c->out, "HTTP/1.1 %s\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: close\r\n"
+        "\r\n", status, type, len);
+    buf_append(&c->out, body, len);
+}
+
+/*
+ * The columns of a /history response being built.
+ */
+struct history_json
+{
+    struct buf time;
+    struct buf value;
+};
+
+void
+history_json_point(void* arg, long long time, double value)
+{
+    struct history_json *h = arg;
+
+    buf_printf(&h->time, "%s%lld.%03lld", h->time.len ? "," : "",
+        time / 1000000000, (time / 1000000) % 1000);
+    buf_printf(&h->value, "%s%.10g", h->value.len ? "," : "", value);
+}
+
+/*
+ * "/history?meter=name[&points=n][&seconds=s]" serves a meter's
+ * history from "-x dir", downsampled to n points (1000 by default),
+ * over the last s seconds or all of it, as columns for plotting:
+ *
+ *   {"meter":"psu","time":[1700000000.123,...],"value":[12.37,...]}
+ *
+ * A long history takes a while to go through, so this runs in a
+ * thread of its own, see http_history_thread().  Only a few run at
+ * once; beyond that requests get "503 Service Unavailable".
+ */
+#define HTTP_HISTORY_POINTS	100000	/* Most a request can ask for. */
+#define HTTP_HISTORY_THREADS	4	/* Most running at once. */
+
+void
+http_history(struct http_client* c, char* query)
+{
+    struct history_json h;
+    struct buf body = { NULL, 0, 0 };
+    struct timespec now;
+    long long since = 0;
+    long points = LTTB_POINTS;
+    char *name = NULL;
+    char *save;
+    char *p;
+    int n;
+
+    for (p = strtok_r(query, "&", &save); p; p = strtok_r(NULL, "&", &save))
+    {
+        if (strncmp(p, "meter=", 6) == 0)
+            name = p + 6;
+        else if (strncmp(p, "points=", 7) == 0)
+            points = atol(p + 7);
+        else if (strncmp(p, "seconds=", 8) == 0)
+        {
+            clock_gettime(CLOCK_REALTIME, &now);
+            since = (now.tv_sec - atoll(p + 8)) * 1000000000LL;
+        }
+    }
+
+    if ((name == NULL) || (points < 3) || (points > HTTP_HISTORY_POINTS))
+    {
+        http_respond(c, "400 Bad Request", "text/plain",
+            "Needs meter= and points= from 3 to 100000\n", 42);
+        return;
+    }
+
+    /* Only the meters we have, which also keeps the name out of paths. */
+    for (n = 0; n < nmeters; n++)
+    {
+        if (strcmp(meters[n].name, name) == 0)
+            break;
+    }
+
+    memset(&h, 0, sizeof(h));
+    if ((history_dir == NULL) || (n == nmeters) ||
+        (history_downsample(history_dir, name, since, points,
+        history_json_point, &h) < 0))
+    {
+        http_respond(c, "404 Not Found", "text/plain", "No history\n", 11);
+        return;
+    }
+
+    /* Escaped as in sample_json(). */
+    buf_printf(&body, "{\"meter\":\"");
+    for (p = name; *p; p++)
+    {
+        if ((*p == '"') || (*p == '\\'))
+            buf_append(&body, "\\", 1);
+        buf_append(&body, p, 1);
+    }
+    buf_printf(&body, "\",\"time\":[");
+    buf_append(&body, h.time.data ? h.time.data : "", h.time.len);
+    buf_printf(&body, "],\"value\":[");
+    buf_append(&body, h.value.data ? h.value.data : "", h.value.len);
+    buf_printf(&body, "]}\n");
+
+    http_respond(c, "200 OK", "application/json", body.data, body.len);
+
+    free(h.time.data);
+    free(h.value.data);
+    free(body.data);
+}
+
+/*
+ * Build a /history response while the server gets on with the other
+ * clients, leaving it to send once the client isn't busy.
+ */
+void*
+http_history_thread(void* arg)
+{
+    struct http_client *c = arg;
+
+    http_history(c, c->query);
+    free(c->query);
+    c->query = NULL;
+
+    atomic_store_explicit(&c->busy, 0, memory_order_release);
+    atomic_fetch_sub(&http.histories, 1);
+    http_wake();
+
+    return NULL;
+}
+
+/*
+ * Handle a request once its header has arrived.
+ */
+void
+http_request(struct http_client* c)
+{
+    char method[8];
+    char path[256];
+    char *query;
+    struct buf body = { NULL, 0, 0 };
+    pthread_t thread;
+    long long start;
+
+    if (sscanf(c->req, "%7s %255s", method, path) != 2)
+    {
+        http_respond(c, "400 Bad Request", "text/plain", "Bad request\n", 12);
+        return;
+    }
+
+    if (strcmp(method, "GET") != 0)
+    {
+        http_respond(c, "405 Method Not Allowed", "text/plain",
+            "GET only\n", 9);
+        return;
+    }
+
+    query = strchr(path, '?');
+    if (query)
+        *query++ = '\0';
+
+    if (strcmp(path, "/events") == 0)
+    {
+        buf_printf(&c->out, "HTTP/1.1 200 OK\r\n"
+            "Content-Type: text/event-stream\r\n"
+            "Cache-Control: no-cache\r\n"
+            "Access-Control-Allow-Origin: *\r\n"
+            "\r\n");
+
+        c->stream = &sse[SSE_ALL];
+        if (query && (strcmp(query, "changes") == 0))
+            c->stream = &sse[SSE_CHANGES];
+        c->pos = atomic_load_explicit(&c->stream->head, memory_order_acquire);
+        return;
+    }
+
+    if (strcmp(path, "/metrics") == 0)
+    {
+        start = trace_begin();
+        metrics_render(&body);
+        trace_end("metrics", start, body.len);
+        http_respond(c, "200 OK",
+            "application/openmetrics-text; version=1.0.0; charset=utf-8",
+            body.data, body.len);
+        free(body.data);
+        return;
+    }
+
+    if (strcmp(path, "/history") == 0)
+    {
+        /* Only this thread adds to the count, so it can't overshoot. */
+        if (atomic_load(&http.histories) >= HTTP_HISTORY_THREADS)
+        {
+            http_respond(c, "503 Service Unavailable", "text/plain",
+                "Busy\n", 5);
+            return;
+        }
+
+        c->query = strdup(query ? query : "");
+        c->busy = 1;
+        atomic_fetch_add(&http.histories, 1);
+        if (pthread_create(&thread, NULL, http_history_thread, c))
+        {
+            atomic_fetch_sub(&http.histories, 1);
+            c->busy = 0;
+            free(c->query);
+            c->query = NULL;
+            http_respond(c, "503 Service Unavailable", "text/plain",
+                "Busy\n", 5);
+            return;
+        }
+        pthread_detach(thread);
+        return;
+    }
+
+    http_respond(c, "404 Not Found", "text/plain", "Not found\n", 10);
+}
+
+/*
+ * Read from a client until we have the whole request header.
+ */
+void
+http_read(struct http_client* c)
+{
+    char junk[256];
+    ssize_t n;
+
+    /* Event stream clients have nothing more to say. */
+    if (c->stream)
+    {
+        n = read(c->fd, junk, sizeof(junk));
+        if ((n == 0) || ((n < 0) && (errno != EAGAIN)))
+            http_close(c);
+        return;
+    }
+
+    n = read(c->fd, c->req + c->reqlen, sizeof(c->req) - 1 - c->reqlen);
+    if (n <= 0)
+    {
+        if ((n == 0) || (errno != EAGAIN))
+            http_close(c);
+        return;
+    }
+
+    c->reqlen += n;
+    c->req[c->reqlen] = '\0';
+
+    if (strstr(c->req, "\r\n\r\n") || strstr(c->req, "\n\n"))
+        http_request(c);
+    else if (c->reqlen == sizeof(c->req) - 1)
+        http_close(c);
+}
+
+/*
+ * Send as much of the response, or of the event stream, as the socket
+ * will take.
+ */
+void
+http_write(struct http_client* c)
+{
+    unsigned long long head;
+    size_t off;
+    size_t len;
+    ssize_t n;
+
+    if (c->outpos < c->out.len)
+    {
+        n = write(c->fd, c->out.data + c->outpos, c->out.len - c->outpos);
+        if (n < 0)
+        {
+            if (errno != EAGAIN)
+                http_close(c);
+            return;
+        }
+
+        c->outpos += n;
+        if ((c->outpos == c->out.len) && (c->stream == NULL))
+            http_close(c);
+        return;
+    }
+
+    head = atomic_load_explicit(&c->stream->head, memory_order_acquire);
+    if (head - c->pos > SSE_RING / 2)
+    {
+        /* Too slow to keep up. */
+        http_close(c);
+        return;
+    }
+
+    off = c->pos % SSE_RING;
+    len = head - c->pos;
+    if (len > SSE_RING - off)
+        len = SSE_RING - off;
+
+    n = write(c->fd, c->stream->ring + off, len);
+    if (n < 0)
+    {
+        if (errno != EAGAIN)
+            http_close(c);
+        return;
+    }
+
+    /*
+     * If the readers lapped us while we were writing, what we sent
+     * may have been overwritten.
+     */
+    head = atomic_load_explicit(&c->stream->head, memory_order_acquire);
+    if (head - c->pos > SSE_RING)
+    {
+        http_close(c);
+        return;
+    }
+
+    c->pos += n;
+}
+
+/*
+ * Does a client have anything waiting to be sent?
+ */
+int
+http_pending(struct http_client* c)
+{
+    if (c->outpos < c->out.len)
+        return 1;
+
+    return c->stream && (c->pos != atomic_load_explicit(&c->stream->head,
+        memory_order_acquire));
+}
+
+void
+http_accept(void)
+{
+    int fd;
+    int n;
+
+    while ((fd = accept(http.fd, NULL, NULL)) >= 0)
+    {
+        for (n = 0; n < HTTP_CLIENTS; n++)
+        {
+            if (http.clients[n].fd < 0)
+                break;
+        }
+
+        if (n == HTTP_CLIENTS)
+        {
+            close(fd);
+            continue;
+        }
+
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        http.clients[n].fd = fd;
+    }
+}
+
+void*
+http_thread(void* arg)
+{
+    static struct pollfd pfd[HTTP_CLIENTS + 2];
+    static int slot[HTTP_CLIENTS + 2];
+    struct http_client *c;
+    char junk[64];
+    int npfd;
+    int n;
+
+    (void)arg;
+
+    trace_thread("http");
+
+    for (;;)
+    {
+        pfd[0].fd = http.fd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = http.wake[0];
+        pfd[1].events = POLLIN;
+        npfd = 2;
+
+        for (n = 0; n < HTTP_CLIENTS; n++)
+        {
+            c = &http.clients[n];
+            if ((c->fd < 0) ||
+                atomic_load_explicit(&c->busy, memory_order_acquire))
+                continue;
+
+            pfd[npfd].fd = c->fd;
+            pfd[npfd].events = http_pending(c) ? POLLOUT : POLLIN;
+            slot[npfd] = n;
+            npfd++;
+        }
+
+        if (poll(pfd, npfd, -1) < 0)
+            continue;
+
+        if (pfd[1].revents & POLLIN)
+        {
+            http.wake_pending = 0;
+            while (read(http.wake[0], junk, sizeof(junk)) > 0)
+                ;
+        }
+
+        for (n = 2; n < npfd; n++)
+        {
+            c = &http.clients[slot[n]];
+
+            if (pfd[n].revents & POLLOUT)
+                http_write(c);
+            else if (pfd[n].revents & (POLLIN | POLLHUP | POLLERR))
+                http_read(c);
+        }
+
+        if (pfd[0].revents & POLLIN)
+            http_accept();
+    }
+
+    return NULL;
+}
+
+/*
+ * Start serving on "[addr:]port".
+ */
+int
+http_start(char* spec)
+{
+    struct addrinfo hints;
+    struct addrinfo *res;
+    char *host;
+    char *service;
+    int on = 1;
+    int err;
+    int n;
+
+    http.listen = spec;
+    if (parse_host_port(spec, &host, &service))
+    {
+        host = HTTP_ADDRESS;
+        service = spec;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    err = getaddrinfo(host, service, &hints, &res);
+    if (err)
+    {
+        printf("%s: %s\n", spec, gai_strerror(err));
+        return -1;
+    }
+
+    http.fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (http.fd < 0)
+    {
+        perror("socket");
+        freeaddrinfo(res);
+        return -1;
+    }
+    setsockopt(http.fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if ((bind(http.fd, res->ai_addr, res->ai_addrlen) < 0) ||
+        (listen(http.fd, 64) < 0))
+    {
+        perror(spec);
+        freeaddrinfo(res);
+        return -1;
+    }
+    freeaddrinfo(res);
+
+    fcntl(http.fd, F_SETFL, fcntl(http.fd, F_GETFL) | O_NONBLOCK);
+
+    if (pipe(http.wake) < 0)
+        return -1;
+    fcntl(http.wake[0], F_SETFL, fcntl(http.wake[0], F_GETFL) | O_NONBLOCK);
+    fcntl(http.wake[1], F_SETFL, fcntl(http.wake[1], F_GETFL) | O_NONBLOCK);
+
+    sse[SSE_ALL].ring = malloc(SSE_RING);
+    sse[SSE_CHANGES].ring = malloc(SSE_RING);
+
+    http.clients = calloc(HTTP_CLIENTS, sizeof(struct http_client));
+    for (n = 0; n < HTTP_CLIENTS; n++)
+        http.clients[n].fd = -1;
+
+    return pthread_create(&http.thread, NULL, http_thread, NULL);
+}
+
+/*
+ ****************************************************************
+ *
+ * Cross-correlation.
+ *
+ ****************************************************************
+ */
+
+/*
+ * "serial-meter xcorr [-s ms] [-l seconds] a b capture ..." works out
+ * how far channel b lags channel a in some captures, e.g. because of
+ * USB latency or the meters' integration times.
+ *
+ * Both channels are linearly interpolated onto a grid of "-s" ms
+ * (100 by default) where they overlap, with HOLD and L samples left
+ * out.  The cross-correlation up to "-l" seconds either way (60 by
+ * default) is computed with FFTs, averaging the cross spectrum of
+ * half-overlapping, zero padded segments, so it needs little memory
+ * and runs in N log(lag) time however long the captures are.
+ *
+ * The lag is where the correlation peaks, refined to a fraction of a
+ * step by fitting a parabola through the peak.  The correlation at
+ * the peak, the level a correlation needs to be significant at 95%,
+ * and the next best peak give an idea of how much to trust it.
+ */
+#define XCORR_STEP	100	/* ms */
+#define XCORR_LAG	60	/* seconds */
+
+/*
+ * In-place radix 2 FFT.  n must be a power of two.
+ */
+void
+fft(double complex* x, int n, int inverse)
+{
+    double complex w;
+    double complex wn;
+    double complex t;
+    int len;
+    int i;
+    int j;
+    int k;
+
+    for (i = 1, j = 0; i < n; i++)
+    {
+        k = n >> 1;
+        while (j & k)
+        {
+            j ^= k;
+            k >>= 1;
+        }
+        j |= k;
+
+        if (i < j)
+        {
+            t = x[i];
+            x[i] = x[j];
+            x[j] = t;
+        }
+    }
+
+    for (len = 2; len <= n; len <<= 1)
+    {
+        wn = cexp((inverse ? 2 : -2) * M_PI * I / len);
+        for (i = 0; i < n; i += len)
+        {
+            w = 1;
+            for (k = 0; k < len / 2; k++)
+            {
+                t = w * x[i + k + len / 2];
+                x[i + k + len / 2] = x[i + k] - t;
+                x[i + k] += t;
+                w *= wn;
+            }
+        }
+    }
+}
+
+/*
+ * A channel read from captures.
+ */
+struct series
+{
+    long long *time;
+    double *value;
+    long n;
+};
+
+/*
+ * Collect the good samples of one meter from the captures, which
+ * must already have been set up as meters.
+ */
+void
+series_load(struct series* s, struct capture** captures, int ncaptures,
+    struct meter* m)
+{
+    struct capture *c;
+    struct capture_record *r;
+    struct sample sample;
+    long size = 0;
+    long n;
+    int i;
+
+    memset(s, 0, sizeof(*s));
+
+    for (i = 0; i < ncaptures; i++)
+    {
+        c = captures[i];
+        if ((m->index < c->first_meter) ||
+            (m->index >= c->first_meter + (int)c->header->nmeters))
+            continue;
+
+        for (n = 0; n < c->nrecords; n++)
+        {
+            r = &c->records[n];
+            if (r->meter != m->index - c->first_meter)
+                continue;
+
+            if (meter_decode(m, r->packet, r->time, r->mono, &sample) ||
+                sample.overload || (sample.attributes & ATTR_HOLD))
+                continue;
+
+            if (s->n == size)
+            {
+                size = size ? size * 2 : 4096;
+                s->time = realloc(s->time, size * sizeof(long long));
+                s->value = realloc(s->value, size * sizeof(double));
+            }
+            s->time[s->n] = r->time;
+            s->value[s->n] = sample.value;
+            s->n++;
+        }
+    }
+}
+
+/*
+ * Linearly interpolate a series onto a grid, and take out its mean.
+ */
+void
+series_resample(struct series* s, long long start, long long step,
+    double* out, long n)
+{
+    long long t;
+    double mean = 0;
+    double f;
+    long j = 0;
+    long i;
+
+    for (i = 0; i < n; i++)
+    {
+        t = start + i * step;
+        while ((j + 1 < s->n) && (s->time[j + 1] <= t))
+            j++;
+
+        if ((j + 1 < s->n) && (s->time[j + 1] > s->time[j]))
+        {
+            f = (double)(t - s->time[j]) / (s->time[j + 1] - s->time[j]);
+            out[i] = s->value[j] + f * (s->value[j + 1] - s->value[j]);
+        }
+        else
+            out[i] = s->value[j];
+
+        mean += out[i];
+    }
+
+    mean /= n;
+    for (i = 0; i < n; i++)
+        out[i] -= mean;
+}
+
+int
+xcorr_main(int argc, char** argv)
+{
+    struct capture **captures;
+    struct series sa;
+    struct series sb;
+    struct meter *ma = NULL;
+    struct meter *mb = NULL;
+    double complex *fa;
+    double complex *fb;
+    double complex *cross;
+    double *a;
+    double *b;
+    double *r;
+    double energy_a = 0;
+    double energy_b = 0;
+    double norm;
+    double best;
+    double next;
+    double lag;
+    double y0, y1, y2;
+    long long step = XCORR_STEP * 1000000LL;
+    long long start;
+    long long end;
+    long maxlag;
+    long npoints;
+    long seg;
+    long half;
+    long peak;
+    long k;
+    long i;
+    int ncaptures;
+    int c;
+    int n;
+
+    maxlag = XCORR_LAG;
+    while ((c = getopt(argc, argv, "s:l:")) != -1)
+    {
+        switch (c)
+        {
+        case 's':
+            step = atol(optarg) * 1000000LL;
+            break;
+        case 'l':
+            maxlag = atol(optarg);
+            break;
+        default:
+            printf("Usage: serial-meter xcorr [-s ms] [-l seconds] "
+                "a b capture ...\n");
+            return 1;
+        }
+    }
+
+    if ((argc - optind < 3) || (step <= 0))
+    {
+        printf("Usage: serial-meter xcorr [-s ms] [-l seconds] "
+            "a b capture ...\n");
+        return 1;
+    }
+
+    ncaptures = argc - optind - 2;
+    captures = calloc(ncaptures, sizeof(struct capture *));
+    nmeters = 0;
+    for (n = 0; n < ncaptures; n++)
+    {
+        captures[n] = capture_open(argv[optind + 2 + n]);
+        if (captures[n] == NULL)
+            return 1;
+        nmeters += captures[n]->header->nmeters;
+    }
+
+    meters = calloc(nmeters, sizeof(struct meter));
+    nmeters = 0;
+    for (n = 0; n < ncaptures; n++)
+    {
+        capture_meters(captures[n], nmeters, n + 1);
+        nmeters += captures[n]->header->nmeters;
+    }
+
+    for (n = 0; n < nmeters; n++)
+    {
+        if (strcmp(meters[n].name, argv[optind]) == 0)
+            ma = &meters[n];
+        if (strcmp(meters[n].name, argv[optind + 1]) == 0)
+            mb = &meters[n];
+    }
+
+    if ((ma == NULL) || (mb == NULL))
+    {
+        printf("No meter called \"%s\" in the captures\n",
+            ma ? argv[optind + 1] : argv[optind]);
+        return 1;
+    }
+
+    series_load(&sa, captures, ncaptures, ma);
+    series_load(&sb, captures, ncaptures, mb);
+
+    if ((sa.n < 2) || (sb.n < 2))
+    {
+        printf("Not enough samples\n");
+        return 1;
+    }
+
+    start = (sa.time[0] > sb.time[0]) ? sa.time[0] : sb.time[0];
+    end = (sa.time[sa.n - 1] < sb.time[sb.n - 1]) ?
+        sa.time[sa.n - 1] : sb.time[sb.n - 1];
+    npoints = (end - start) / step + 1;
+
+    /* Segments are zero padded to twice the data, for linear lags. */
+    maxlag = maxlag * 1000000000LL / step;
+    if (maxlag > npoints - 1)
+        maxlag = npoints - 1;
+    for (seg = 2; seg / 2 < 2 * maxlag; seg <<= 1)
+        ;
+    half = seg / 2;
+
+    if ((end <= start) || (maxlag < 1))
+    {
+        printf("The channels don't overlap enough\n");
+        return 1;
+    }
+
+    a = calloc(npoints + half, sizeof(double));
+    b = calloc(npoints + half, sizeof(double));
+    series_resample(&sa, start, step, a, npoints);
+    series_resample(&sb, start, step, b, npoints);
+
+    for (i = 0; i < npoints; i++)
+    {
+        energy_a += a[i] * a[i];
+        energy_b += b[i] * b[i];
+    }
+
+    fa = malloc(seg * sizeof(double complex));
+    fb = malloc(seg * sizeof(double complex));
+    cross = calloc(seg, sizeof(double complex));
+
+    /*
+     * Add up the cross spectra of the segments.  Each pairs a quarter
+     * segment of a with the half segment of b that starts at the same
+     * point, so every pair of points up to maxlag apart is counted
+     * exactly once, and the padding keeps the circular correlation
+     * from wrapping round.
+     */
+    for (i = 0; i < npoints; i += half / 2)
+    {
+        for (k = 0; k < seg; k++)
+        {
+            fa[k] = (k < half / 2) && (i + k < npoints) ? a[i + k] : 0;
+            fb[k] = (k < half) && (i + k < npoints) ? b[i + k] : 0;
+        }
+        fft(fa, seg, 0);
+        fft(fb, seg, 0);
+        for (k = 0; k < seg; k++)
+            cross[k] += conj(fa[k]) * fb[k];
+    }
+    fft(cross, seg, 1);
+
+    /*
+     * Positive lags come from the first half of each segment of a
+     * against b.  Negative lags are the same thing the other way
+     * round, found at the end of the circular result.
+     */
+    norm = sqrt(energy_a * energy_b) * seg;
+    r = calloc(2 * maxlag + 1, sizeof(double));
+    for (k = 0; k <= maxlag; k++)
+        r[maxlag + k] = creal(cross[k]) / norm;
+
+    memset(cross, 0, seg * sizeof(double complex));
+    for (i = 0; i < npoints; i += half / 2)
+    {
+        for (k = 0; k < seg; k++)
+        {
+            fa[k] = (k < half / 2) && (i + k < npoints) ? b[i + k] : 0;
+            fb[k] = (k < half) && (i + k < npoints) ? a[i + k] : 0;
+        }
+        fft(fa, seg, 0);
+        fft(fb, seg, 0);
+        for (k = 0; k < seg; k++)
+            cross[k] += conj(fa[k]) * fb[k];
+    }
+    fft(cross, seg, 1);
+    for (k = 1; k <= maxlag; k++)
+        r[maxlag - k] = creal(cross[k]) / norm;
+
+    peak = 0;
+    for (k = 0; k <= 2 * maxlag; k++)
+    {
+        if (fabs(r[k]) > fabs(r[peak]))
+            peak = k;
+    }
+    best = r[peak];
+
+    /* The best other local maximum. */
+    next = 0;
+    for (k = 1; k < 2 * maxlag; k++)
+    {
+        if ((k < peak - 1 || k > peak + 1) &&
+            (fabs(r[k]) >= fabs(r[k - 1])) && (fabs(r[k]) >= fabs(r[k + 1])) &&
+            (fabs(r[k]) > fabs(next)))
+            next = r[k];
+    }
+
+    lag = peak - maxlag;
+    if ((peak > 0) && (peak < 2 * maxlag))
+    {
+        y0 = fabs(r[peak - 1]);
+        y1 = fabs(r[peak]);
+        y2 = fabs(r[peak + 1]);
+        if (y0 - 2 * y1 + y2 != 0)
+            lag += 0.5 * (y0 - y2) / (y0 - 2 * y1 + y2);
+    }
+
+    printf("%s lags %s by %.3f s\n", mb->name, ma->name, lag * step / 1e9);
+    printf("  correlation %.3f at the peak, %.3f needed for 95%% "
+        "significance\n", best, 1.96 / sqrt(npoints));
+    if (next != 0)
+        printf("  next best peak %.3f\n", next);
+    printf("  %ld points at %.3f s over %.1f hours\n", npoints, step / 1e9,
+        (end - start) / 3.6e12);
+
+    return 0;
+}
+
+/*
+ ****************************************************************
+ *
+ * Benchmarks.
+ *
+ ****************************************************************
+ */
+
+/*
+ * "serial-meter bench [-n frames] [-o file] [-c file] [capture ...]"
+ * times each stage of decoding, and the whole pipeline, over a corpus
+ * of frames: the example from the top of this file, every packet in
+ * the captures given, and BENCH_SYNTHETIC random but valid frames.
+ *
+ * Each stage is run over "-n" frames (BENCH_FRAMES by default)
+ * BENCH_RUNS times, and the fastest run is reported as ns per frame,
+ * along with the instructions and cache misses per frame from
+ * perf_event_open() where the kernel allows it.  Anything the stages
+ * print goes to /dev/null.
+ *
+ * "-o file" saves the results as JSON, one stage per line, and "-c
+ * file" compares against results saved from another build.
+ */
+#define BENCH_FRAMES	1000000
+#define BENCH_RUNS	5
+#define BENCH_SYNTHETIC	4096
+#define BENCH_STAGES	6
+
+struct bench
+{
+    unsigned char (*nibbles)[14];	/* As read_packet() returns them. */
+    unsigned long *attributes;
+    long nframes;
+    long count;			/* Frames per run. */
+    struct meter meter;		/* Reads the frames as sent. */
+    unsigned long sink;		/* Results, so they aren't optimised away. */
+    int null;			/* /dev/null, for what the stages print. */
+};
+
+struct bench_result
+{
+    char *stage;
+    double ns;
+    double instructions;	/* -1 if they couldn't be counted. */
+    double cache_misses;
+};
+
+void
+bench_read_packet(struct bench* b)
+{
+    unsigned char buf[14];
+    long n;
+
+    for (n = 0; n < b->count; n++)
+    {
+        if (read_packet(&b->meter, buf) == -2)
+        {
+            lseek(b->meter.fd, 0, SEEK_SET);
+            n--;
+            continue;
+        }
+        b->sink += buf[13];
+    }
+}
+
+void
+bench_decode_digit(struct bench* b)
+{
+    unsigned char *p;
+    long n;
+
+    for (n = 0; n < b->count; n++)
+    {
+        p = b->nibbles[n % b->nframes];
+        b->sink += decode_digit(p[1], p[2]) + decode_digit(p[3], p[4]) +
+            decode_digit(p[5], p[6]) + decode_digit(p[7], p[8]);
+    }
+}
+
+void
+bench_decode_display_number(struct bench* b)
+{
+    struct sample s;
+    long n;
+
+    for (n = 0; n < b->count; n++)
+    {
+        decode_display_number(b->nibbles[n % b->nframes], &s);
+        b->sink += s.count;
+    }
+}
+
+void
+bench_decode_attributes(struct bench* b)
+{
+    long n;
+
+    for (n = 0; n < b->count; n++)
+        b->sink += decode_attributes(b->nibbles[n % b->nframes]);
+}
+
+void
+bench_print_attributes(struct bench* b)
+{
+    long n;
+
+    for (n = 0; n < b->count; n++)
+        print_attributes(b->attributes[n % b->nframes]);
+}
+
+/*
+ * Everything the reader thread does for a frame with the default
+ * output.
+ */
+void
+bench_pipeline(struct bench* b)
+{
+    unsigned char buf[14];
+    struct sample s;
+    long n;
+
+    for (n = 0; n < b->count; n++)
+    {
+        if (read_packet(&b->meter, buf) == -2)
+        {
+            lseek(b->meter.fd, 0, SEEK_SET);
+            n--;
+            continue;
+        }
+        if (meter_decode(&b->meter, buf, n, n, &s) == 0)
+            emit_sample(&s);
+    }
+}
+
+/*
+ * Open a hardware counter for this thread, in group if it isn't -1.
+ */
+int
+perf_open(unsigned long long config, int group)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = (group == -1);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+void
+bench_run(struct bench* b, char* stage, void (*run)(struct bench*),
+    int perf, struct bench_result* r)
+{
+    struct
+    {
+        uint64_t nr;
+        uint64_t values[2];
+    } counts;
+    struct timespec start;
+    struct timespec end;
+    double ns;
+    int out;
+    int i;
+
+    r->stage = stage;
+    r->ns = -1;
+    r->instructions = -1;
+    r->cache_misses = -1;
+
+    fflush(stdout);
+    out = dup(1);
+    dup2(b->null, 1);
+
+    for (i = 0; i < BENCH_RUNS; i++)
+    {
+        lseek(b->meter.fd, 0, SEEK_SET);
+        b->meter.rpos = b->meter.rlen = 0;
+
+        if (perf >= 0)
+        {
+            ioctl(perf, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(perf, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        run(b);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (perf >= 0)
+            ioctl(perf, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+        ns = ((end.tv_sec - start.tv_sec) * 1e9 +
+            (end.tv_nsec - start.tv_nsec)) / b->count;
+        if ((r->ns >= 0) && (ns >= r->ns))
+            continue;
+
+        r->ns = ns;
+        if ((perf >= 0) && (read(perf, &counts, sizeof(counts)) > 0) &&
+            (counts.nr == 2))
+        {
+            r->instructions = (double)counts.values[0] / b->count;
+            r->cache_misses = (double)counts.values[1] / b->count;
+        }
+    }
+
+    fflush(stdout);
+    dup2(out, 1);
+    close(out);
+}
+
+/*
+ * Add the frames the program would read from a meter to a file and
+ * to the corpus.
+ */
+void
+bench_add(struct bench* b, FILE* f, unsigned char* nibbles)
+{
+    int n;
+
+    for (n = 0; n < 14; n++)
+        putc(((n + 1) << 4) | nibbles[n], f);
+
+    memcpy(b->nibbles[b->nframes], nibbles, 14);
+    b->attributes[b->nframes] = decode_attributes(nibbles);
+    b->nframes++;
+}
+
+/*
+ * Read the results saved by "-o".
+ */
+int
+bench_load(char* file, struct bench_result* results, int max)
+{
+    char line[256];
+    char stage[64];
+    FILE *f;
+    int n = 0;
+
+    f = fopen(file, "r");
+    if (f == NULL)
+    {
+        perror(file);
+        return -1;
+    }
+
+    while ((n < max) && fgets(line, sizeof(line), f))
+    {
+        if (sscanf(line, " {\"stage\":\"%63[^\"]\",\"ns\":%lf",
+            stage, &results[n].ns) == 2)
+            results[n++].stage = strdup(stage);
+    }
+
+    fclose(f);
+    return n;
+}
+
+int
+bench_main(int argc, char** argv)
+{
+    static unsigned char example[14] =
+    {
+        0x0, 0x7, 0xD, 0x2, 0x7, 0x9, 0x5, 0x0, 0x5, 0x2, 0x0, 0x4, 0x0, 0x8
+    };
+    static struct
+    {
+        char *name;
+        void (*run)(struct bench*);
+    } stages[BENCH_STAGES] =
+    {
+        { "read_packet", bench_read_packet },
+        { "decode_digit", bench_decode_digit },
+        { "decode_display_number", bench_decode_display_number },
+        { "decode_attributes", bench_decode_attributes },
+        { "print_attributes", bench_print_attributes },
+        { "pipeline", bench_pipeline }
+    };
+    struct bench_result results[BENCH_STAGES];
+    struct bench_result before[BENCH_STAGES];
+    struct bench b;
+    struct capture *c;
+    unsigned char nibbles[14];
+    char *output = NULL;
+    char *compare = NULL;
+    long total;
+    long n;
+    FILE *f;
+    FILE *out;
+    int nbefore = 0;
+    int perf;
+    int i;
+    int j;
+
+    memset(&b, 0, sizeof(b));
+    b.count = BENCH_FRAMES;
+
+    while ((i = getopt(argc, argv, "n:o:c:")) != -1)
+    {
+        switch (i)
+        {
+        case 'n':
+            b.count = atol(optarg);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'c':
+            compare = optarg;
+            break;
+        default:
+            printf("Usage: serial-meter bench [-n frames] [-o file] "
+                "[-c file] [capture ...]\n");
+            return 1;
+        }
+    }
+
+    if (b.count <= 0)
+        b.count = BENCH_FRAMES;
+
+    /* The pipeline stage emits with the default settings. */
+    if (config_start())
+        return 1;
+
+    if (compare)
+    {
+        nbefore = bench_load(compare, before, BENCH_STAGES);
+        if (nbefore < 0)
+            return 1;
+    }
+
+    /* Size the corpus. */
+    total = 1 + BENCH_SYNTHETIC;
+    for (i = optind; i < argc; i++)
+    {
+        c = capture_open(argv[i]);
+        if (c == NULL)
+            return 1;
+        total += c->nrecords;
+        munmap(c->header, sizeof(struct capture_header) +
+            c->header->nmeters * CAPTURE_NAME +
+            c->nrecords * sizeof(struct capture_record));
+        free(c);
+    }
+
+    b.nibbles = malloc(total * 14);
+    b.attributes = malloc(total * sizeof(unsigned long));
+
+    f = tmpfile();
+    if (f == NULL)
+    {
+        perror("tmpfile");
+        return 1;
+    }
+
+    bench_add(&b, f, example);
+
+    for (i = optind; i < argc; i++)
+    {
+        c = capture_open(argv[i]);
+        if (c == NULL)
+            return 1;
+        for (n = 0; n < c->nrecords; n++)
+            bench_add(&b, f, c->records[n].packet);
+    }
+
+    /*
+     * Random frames: digits (including L and blank) with random signs
+     * and decimal points, and random attribute bits.
+     */
+    srandom(1);
+    for (n = 0; n < BENCH_SYNTHETIC; n++)
+    {
+        for (j = 0; j < 14; j++)
+            nibbles[j] = random() & 0xF;
+        for (j = 1; j < 9; j += 2)
+        {
+            i = lcd_segments[random() % 12];
+            nibbles[j] = (nibbles[j] & 0x8) | (i >> 4);
+            nibbles[j + 1] = i & 0xF;
+        }
+        bench_add(&b, f, nibbles);
+    }
+
+    fflush(f);
+    b.meter.name = "bench";
+    b.meter.port = "bench";
+    b.meter.source = SOURCE_TTY;
+    b.meter.fd = fileno(f);
+    meters = &b.meter;
+    nmeters = 1;
+
+    b.null = open("/dev/null", O_WRONLY);
+    if (b.null < 0)
+    {
+        perror("/dev/null");
+        return 1;
+    }
+
+    perf = perf_open(PERF_COUNT_HW_INSTRUCTIONS, -1);
+    if ((perf >= 0) && (perf_open(PERF_COUNT_HW_CACHE_MISSES, perf) < 0))
+    {
+        close(perf);
+        perf = -1;
+    }
+    if (perf < 0)
+        printf("No hardware counters: %s\n", strerror(errno));
+
+    printf("%ld frames in the corpus, %ld per run\n\n", b.nframes, b.count);
+    printf("%-22s %10s %12s %12s\n", "stage", "ns/frame", "instructions",
+        "cache misses");
+
+    for (i = 0; i < BENCH_STAGES; i++)
+    {
+        bench_run(&b, stages[i].name, stages[i].run, perf, &results[i]);
+
+        printf("%-22s %10.2f", results[i].stage, results[i].ns);
+        if (results[i].instructions >= 0)
+            printf(" %12.1f %12.3f", results[i].instructions,
+                results[i].cache_misses);
+        else
+            printf(" %12s %12s", "-", "-");
+
+        for (j = 0; j < nbefore; j++)
+        {
+            if (strcmp(before[j].stage, results[i].stage) == 0)
+                printf("  %+.1f%%",
+                    (results[i].ns - before[j].ns) / before[j].ns * 100);
+        }
+        printf("\n");
+    }
+    close(b.null);
+
+    if (output)
+    {
+        out = fopen(output, "w");
+        if (out == NULL)
+        {
+            perror(output);
+            return 1;
+        }
+
+        fprintf(out, "{\"compiler\":\"%s\",\"frames\":%ld,\"corpus\":%ld,"
+            "\"stages\":[\n", __VERSION__, b.count, b.nframes);
+        for (i = 0; i < BENCH_STAGES; i++)
+        {
+            fprintf(out, "  {\"stage\":\"%s\",\"ns\":%.3f,", results[i].stage,
+                results[i].ns);
+            if (results[i].instructions >= 0)
+                fprintf(out, "\"instructions\":%.1f,\"cache_misses\":%.3f}",
+                    results[i].instructions, results[i].cache_misses);
+            else
+                fprintf(out, "\"instructions\":null,\"cache_misses\":null}");
+            fprintf(out, "%s\n", (i < BENCH_STAGES - 1) ? "," : "");
+        }
+        fprintf(out, "]}\n");
+        fclose(out);
+    }
+
+    return 0;
+}
+
+/*
+ ****************************************************************
+ *
+ * Latency.
+ *
+ ****************************************************************
+ */
+
+/*
+ * "serial-meter latency [-p ports,...] [-n frames] [-r rate] [-l us]
+ * [-- options]" measures how long a frame takes to come out of the
+ * program, from its last byte being written to the line being read.
+ *
+ * For each port count it runs a copy of this program, with "options"
+ * (such as -m or -i, to load it with outputs), reading pty pairs as if
+ * they were meters and writing to a pty as if to a terminal.  Each
+ * port is sent "-r" frames a second ("-n" in all, over all ports),
+ * each showing its sequence number so the lines can be matched up,
+ * and p50, p99, p99.9 and the worst latency are reported.  With "-l"
+ * the exit status is 1 if any p99 is over that many us, for use as a
+ * regression check.
+ */
+#define LATENCY_FRAMES	10000
+#define LATENCY_RATE	100	/* Frames a second per port. */
+#define LATENCY_PORTS	32
+
+long long
+latency_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/*
+ * Open a pty pair in raw mode.  Returns the master, and the slave and
+ * its name through slave and name.
+ */
+int
+latency_pty(int* slave, char* name)
+{
+    struct termios t;
+    int master;
+
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if ((master < 0) || grantpt(master) || unlockpt(master))
+    {
+        perror("posix_openpt");
+        return -1;
+    }
+
+    strcpy(name, ptsname(master));
+    *slave = open(name, O_RDWR | O_NOCTTY);
+    if (*slave < 0)
+    {
+        perror(name);
+        return -1;
+    }
+
+    /* No line editing, echo or newline translation. */
+    tcgetattr(*slave, &t);
+    cfmakeraw(&t);
+    tcsetattr(*slave, TCSANOW, &t);
+
+    return master;
+}
+
+/*
+ * Make the bytes a meter would send to show n (0-9999).
+ */
+void
+latency_frame(unsigned char* frame, int n)
+{
+    static unsigned char example[14] =
+    {
+        0x0, 0x7, 0xD, 0x2, 0x7, 0x9, 0x5, 0x0, 0x5, 0x2, 0x0, 0x4, 0x0, 0x8
+    };
+    int digit;
+    int i;
+
+    for (i = 0; i < 14; i++)
+        frame[i] = ((i + 1) << 4) | example[i];
+
+    for (i = 7; i > 0; i -= 2)
+    {
+        digit = lcd_segments[n % 10];
+        frame[i] = ((i + 1) << 4) | (digit >> 4);
+        frame[i + 1] = ((i + 2) << 4) | (digit & 0xF);
+        n /= 10;
+    }
+}
+
+int
+latency_compare(const void* a, const void* b)
+{
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * One run with nports ports.  Returns the p99 in ns, or -1.
+ */
+long long
+latency_run(int nports, long frames, int rate, char** options,
+    int noptions)
+{
+    char names[LATENCY_PORTS][32];
+    char outname[32];
+    int masters[LATENCY_PORTS];
+    int slaves[LATENCY_PORTS];
+    char **args;
+    long long *sent;
+    long long *latency;
+    long long next;
+    long long now;
+    long long period;
+    unsigned char frame[14];
+    char line[256];
+    char buf[4096];
+    struct pollfd pfd;
+    long nsent = 0;
+    long nseen = 0;
+    long seq;
+    int linelen = 0;
+    int outslave;
+    int out;
+    pid_t pid;
+    ssize_t len;
+    char *p;
+    int i;
+    int n;
+
+    for (i = 0; i < nports; i++)
+    {
+        masters[i] = latency_pty(&slaves[i], names[i]);
+        if (masters[i] < 0)
+            return -1;
+    }
+    out = latency_pty(&outslave, outname);
+    if (out < 0)
+        return -1;
+
+    args = calloc(noptions + nports + 2, sizeof(char *));
+    args[0] = "serial-meter";
+    for (i = 0; i < noptions; i++)
+        args[1 + i] = options[i];
+    for (i = 0; i < nports; i++)
+    {
+        args[1 + noptions + i] = malloc(48);
+        sprintf(args[1 + noptions + i], "p%d=%s", i, names[i]);
+    }
+
+    pid = fork();
+    if (pid == 0)
+    {
+        dup2(outslave, 1);
+        execv("/proc/self/exe", args);
+        perror("/proc/self/exe");
+        _exit(1);
+    }
+
+    /* Let it open the ports. */
+    poll(NULL, 0, 500);
+
+    /*
+     * Sequence numbers only go up to 9999, so frames are matched to
+     * lines with sent[] indexed modulo 10000 per port.
+     */
+    sent = calloc(nports * 10000, sizeof(long long));
+    latency = calloc(frames, sizeof(long long));
+    period = 1000000000LL / rate / nports;
+    next = latency_now();
+
+    while (nseen < frames)
+    {
+        now = latency_now();
+        if ((nsent < frames) && (now >= next))
+        {
+            i = nsent % nports;
+            seq = (nsent / nports) % 10000;
+            latency_frame(frame, seq);
+            sent[i * 10000 + seq] = latency_now();
+            if (write(masters[i], frame, 14) != 14)
+                break;
+            nsent++;
+            next += period;
+            continue;
+        }
+
+        pfd.fd = out;
+        pfd.events = POLLIN;
+        n = (nsent < frames) ? (next - now) / 1000000 : 1000;
+        if (poll(&pfd, 1, n) == 0)
+        {
+            if (nsent == frames)
+                break;	/* Lost the rest. */
+            continue;
+        }
+
+        len = read(out, buf, sizeof(buf));
+        now = latency_now();
+        if (len <= 0)
+            break;
+
+        for (p = buf; p < buf + len; p++)
+        {
+            if (*p != '\n')
+            {
+                if (linelen < (int)sizeof(line) - 1)
+                    line[linelen++] = *p;
+                continue;
+            }
+            line[linelen] = '\0';
+            linelen = 0;
+
+            /* There's no "name: " with only one meter. */
+            i = 0;
+            if (((sscanf(line, "p%d: %ld", &i, &seq) == 2) ||
+                ((nports == 1) && (sscanf(line, "%ld", &seq) == 1))) &&
+                (i >= 0) && (i < nports) && (seq >= 0) && (seq < 10000) &&
+                sent[i * 10000 + seq])
+            {
+                latency[nseen++] = now - sent[i * 10000 + seq];
+                sent[i * 10000 + seq] = 0;
+            }
+        }
+    }
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    for (i = 0; i < nports; i++)
+    {
+        close(masters[i]);
+        close(slaves[i]);
+        free(args[1 + noptions + i]);
+    }
+    close(out);
+    close(outslave);
+    free(args);
+    free(sent);
+
+    if (nseen == 0)
+    {
+        printf("%5d  no output\n", nports);
+        free(latency);
+        return -1;
+    }
+
+    qsort(latency, nseen, sizeof(long long), latency_compare);
+    printf("%5d %8ld %10.1f %10.1f %10.1f %10.1f\n", nports, frames - nseen,
+        latency[nseen / 2] / 1e3, latency[nseen * 99 / 100] / 1e3,
+        latency[nseen * 999 / 1000] / 1e3, latency[nseen - 1] / 1e3);
+
+    now = latency[nseen * 99 / 100];
+    free(latency);
+
+    return now;
+}
+
+int
+latency_main(int argc, char** argv)
+{
+    char *ports = "1";
+    long frames = LATENCY_FRAMES;
+    int rate = LATENCY_RATE;
+    long long limit = 0;
+    long long p99;
+    int nports;
+    int failed = 0;
+    char *p;
+    int c;
+
+    while ((c = getopt(argc, argv, "p:n:r:l:")) != -1)
+    {
+        switch (c)
+        {
+        case 'p':
+            ports = optarg;
+            break;
+        case 'n':
+            frames = atol(optarg);
+            break;
+        case 'r':
+            rate = atoi(optarg);
+            break;
+        case 'l':
+            limit = atol(optarg) * 1000LL;
+            break;
+        default:
+            printf("Usage: serial-meter latency [-p ports,...] [-n frames] "
+                "[-r rate] [-l us] [-- options]\n");
+            return 1;
+        }
+    }
+
+    if ((frames <= 0) || (rate <= 0))
+    {
+        printf("Bad frame count or rate\n");
+        return 1;
+    }
+
+    printf("ports     lost    p50 us     p99 us   p99.9 us     max us\n");
+
+    for (p = ports; *p; )
+    {
+        nports = strtol(p, &p, 10);
+        if (*p == ',')
+            p++;
+        if ((nports < 1) || (nports > LATENCY_PORTS))
+        {
+            printf("Between 1 and %d ports\n", LATENCY_PORTS);
+            return 1;
+        }
+
+        p99 = latency_run(nports, frames, rate, argv + optind, argc - optind);
+        if ((p99 < 0) || (limit && (p99 > limit)))
+            failed = 1;
+    }
+
+    return failed;
+}
+
+/*
+ ****************************************************************
+ *
+ * Attribute analysis.
+ *
+ ****************************************************************
+ */
+
+/*
+ * "serial-meter attributes [-j threads] capture ..." helps work out
+ * what the unknown attribute bits mean from large captures: how often
+ * each of the 24 bits is set in each mode the meter was in, which
+ * bits go together, and which follow the reading.
+ *
+ * The captures are split into chunks, handed out to the threads as
+ * they finish the last, and each thread counts the packets it decodes
+ * by their combination of attributes in a hash table of its own.  A
+ * meter only shows a few dozen combinations, so a packet costs a
+ * decode and a lookup, and the tables are quick to merge at the end.
+ * All the statistics are worked out from the merged table.
+ */
+#define ANALYSE_CHUNK	(1 << 16)	/* Records */
+#define ANALYSE_PHI	0.5	/* Report bits going together above this, */
+#define ANALYSE_R	0.3	/* and bits following the reading. */
+
+/* The attributes that say what is being measured. */
+#define ATTR_MODE	(ATTR_AC | ATTR_DC | ATTR_DIODE | ATTR_PERCENT | \
+    ATTR_OHMS | ATTR_FARAD | ATTR_HERTZ | ATTR_VOLTS | ATTR_AMPS | ATTR_DEGC)
+
+/*
+ * The packets seen with one combination of attributes.
+ */
+struct combination
+{
+    unsigned long attributes;
+    int used;
+    long n;
+    long overloads;
+    double sum;			/* Of the values of the others. */
+    double sumsq;
+};
+
+struct analysis
+{
+    pthread_t thread;
+    struct combination *table;
+    int size;			/* A power of two. */
+    int used;
+    long packets;
+    long failures;
+};
+
+/*
+ * The statistics for one mode.
+ */
+struct analysis_mode
+{
+    unsigned long mode;
+    long n;
+    long values;
+    double sum;
+    double sumsq;
+    long set[24];
+    long set_values[24];
+    double set_sum[24];
+};
+
+struct
+{
+    struct capture **captures;
+    int ncaptures;
+    long nchunks;
+    atomic_long next;
+} analyse;
+
+/*
+ * Find the entry for a combination of attributes, adding it if it's
+ * new.
+ */
+struct combination*
+analysis_find(struct analysis* a, unsigned long attributes)
+{
+    struct combination *old;
+    unsigned int h;
+    int size;
+    int n;
+
+    if (a->used * 2 >= a->size)
+    {
+        old = a->table;
+        size = a->size;
+        a->size = size ? size * 2 : 64;
+        a->table = calloc(a->size, sizeof(struct combination));
+        a->used = 0;
+        for (n = 0; n < size; n++)
+        {
+            if (old[n].used)
+                *analysis_find(a, old[n].attributes) = old[n];
+        }
+        free(old);
+    }
+
+    h = (attributes * 2654435761u) & (a->size - 1);
+    while (a->table[h].used && (a->table[h].attributes != attributes))
+        h = (h + 1) & (a->size - 1);
+
+    if (!a->table[h].used)
+    {
+        a->table[h].used = 1;
+        a->table[h].attributes = attributes;
+        a->used++;
+    }
+
+    return &a->table[h];
+}
+
+void
+analysis_add(struct analysis* a, struct combination* c)
+{
+    struct combination *to;
+
+    to = analysis_find(a, c->attributes);
+    to->n += c->n;
+    to->overloads += c->overloads;
+    to->sum += c->sum;
+    to->sumsq += c->sumsq;
+}
+
+/*
+ * Count the packets of a run of records.
+ */
+void
+analysis_records(struct analysis* a, struct capture_record* r, long n)
+{
+    struct combination *c;
+    struct sample s;
+    int i;
+
+    for (; n > 0; n--, r++)
+    {
+        a->packets++;
+
+        /* Check the digits first, as decoding complains about them. */
+        for (i = 1; i < 8; i += 2)
+        {
+            if (decode_digit(r->packet[i], r->packet[i + 1]) == -1)
+                break;
+        }
+        if ((i < 8) || (decode_display_number(r->packet, &s) != 0))
+        {
+            a->failures++;
+            continue;
+        }
+
+        s.attributes = decode_attributes(r->packet);
+        c = analysis_find(a, s.attributes);
+        c->n++;
+        if (s.overload)
+            c->overloads++;
+        else
+        {
+            s.value = sample_value(&s);
+            c->sum += s.value;
+            c->sumsq += s.value * s.value;
+        }
+    }
+}
+
+void*
+analysis_thread(void* arg)
+{
+    struct analysis *a = arg;
+    struct capture *c = NULL;
+    long chunk;
+    long start;
+    long n;
+    int i;
+
+    while ((chunk = atomic_fetch_add(&analyse.next, 1)) < analyse.nchunks)
+    {
+        /* Find the capture the chunk is in. */
+        for (i = 0; i < analyse.ncaptures; i++)
+        {
+            c = analyse.captures[i];
+            n = (c->nrecords + ANALYSE_CHUNK - 1) / ANALYSE_CHUNK;
+            if (chunk < n)
+                break;
+            chunk -= n;
+        }
+
+        start = chunk * ANALYSE_CHUNK;
+        n = c->nrecords - start;
+        if (n > ANALYSE_CHUNK)
+            n = ANALYSE_CHUNK;
+        analysis_records(a, c->records + start, n);
+    }
+
+    return NULL;
+}
+
+/*
+ * The label of a bit in the protocol description, e.g. "E8".
+ */
+void
+analysis_label(char* label, int bit)
+{
+    sprintf(label, "%c%d", (bit < 4) ? '1' : 'A' + bit / 4 - 1,
+        1 << (bit % 4));
+}
+
+void
+analysis_mode_name(char* name, size_t len, unsigned long mode)
+{
+    size_t n = 0;
+    int bit;
+
+    name[0] = '\0';
+    for (bit = 0; bit < 24; bit++)
+    {
+        if ((mode & (1UL << bit)) && (n < len))
+            n += snprintf(name + n, len - n, "%s%s", n ? " " : "",
+                attribute_table[bit]);
+    }
+
+    if (n == 0)
+        snprintf(name, len, "(none)");
+}
+
+/*
+ * The correlation of two bits, from how often they're set together.
+ */
+double
+analysis_phi(long n, long a, long b, long both)
+{
+    double d;
+
+    d = (double)a * (n - a) * b * (n - b);
+    if (d == 0)
+        return 0;
+
+    return ((double)both * n - (double)a * b) / sqrt(d);
+}
+
+void
+analysis_report(struct analysis* total, long records, double seconds)
+{
+    struct analysis_mode *modes;
+    struct analysis_mode *m;
+    struct combination *c;
+    long set[24] = { 0 };
+    long pairs[24][24];
+    char label[8];
+    char other[8];
+    char name[128];
+    double mean, mean1, mean0, sd, p, r;
+    long values;
+    long found;
+    int nmodes = 0;
+    int i;
+    int j;
+    int k;
+
+    memset(pairs, 0, sizeof(pairs));
+    modes = calloc(total->used, sizeof(struct analysis_mode));
+
+    for (k = 0; k < total->size; k++)
+    {
+        c = &total->table[k];
+        if (!c->used)
+            continue;
+
+        for (j = 0; j < nmodes; j++)
+        {
+            if (modes[j].mode == (c->attributes & ATTR_MODE))
+                break;
+        }
+        m = &modes[j];
+        if (j == nmodes)
+        {
+            m->mode = c->attributes & ATTR_MODE;
+            nmodes++;
+        }
+
+        values = c->n - c->overloads;
+        m->n += c->n;
+        m->values += values;
+        m->sum += c->sum;
+        m->sumsq += c->sumsq;
+
+        for (i = 0; i < 24; i++)
+        {
+            if (!(c->attributes & (1UL << i)))
+                continue;
+
+            set[i] += c->n;
+            m->set[i] += c->n;
+            m->set_values[i] += values;
+            m->set_sum[i] += c->sum;
+            for (j = 0; j < 24; j++)
+            {
+                if (c->attributes & (1UL << j))
+                    pairs[i][j] += c->n;
+            }
+        }
+    }
+
+    printf("%ld packets in %.2f s (%.0f MB/s), %ld not decoded, "
+        "%d combinations of attributes\n\n", records, seconds,
+        records * sizeof(struct capture_record) / seconds / 1e6,
+        total->failures, total->used);
+
+    printf("%-28s %12s %12s\n", "mode", "packets", "L");
+    for (j = 0; j < nmodes; j++)
+    {
+        analysis_mode_name(name, sizeof(name), modes[j].mode);
+        printf("%-28s %12ld %12ld\n", name, modes[j].n,
+            modes[j].n - modes[j].values);
+    }
+
+    /*
+     * A bit set in most packets is described by the modes where it
+     * isn't always set, and any other by the modes where it is.
+     */
+    printf("\n%-3s %-16s %7s  %s\n", "bit", "name", "set", "by mode");
+    for (i = 0; i < 24; i++)
+    {
+        analysis_label(label, i);
+        printf("%-3s %-16s %6.1f%%  ", label, attribute_table[i],
+            total->packets ? 100.0 * set[i] / (total->packets -
+            total->failures) : 0.0);
+
+        found = 0;
+        for (j = 0; j < nmodes; j++)
+        {
+            m = &modes[j];
+            if ((set[i] * 2 > total->packets - total->failures) ?
+                (m->set[i] == m->n) : (m->set[i] == 0))
+                continue;
+
+            analysis_mode_name(name, sizeof(name), m->mode);
+            printf("%s%s%s %.1f%%", found ? ", " : "",
+                (!found && (set[i] * 2 > total->packets - total->failures)) ?
+                "except " : "", name, 100.0 * m->set[i] / m->n);
+            found++;
+        }
+        if (!found)
+            printf((set[i] * 2 > total->packets - total->failures) ?
+                "always" : "never");
+        printf("\n");
+    }
+
+    printf("\nbits that go together (|phi| >= %.1f)\n", ANALYSE_PHI);
+    for (i = 0; i < 24; i++)
+    {
+        for (j = i + 1; j < 24; j++)
+        {
+            p = analysis_phi(total->packets - total->failures, set[i], set[j],
+                pairs[i][j]);
+            if (fabs(p) < ANALYSE_PHI)
+                continue;
+
+            analysis_label(label, i);
+            analysis_label(other, j);
+            printf("%-3s %-16s %-3s %-16s %6.3f\n", label, attribute_table[i],
+                other, attribute_table[j], p);
+        }
+    }
+
+    /*
+     * The point-biserial correlation of each bit with the reading, in
+     * each mode where the bit comes and goes.
+     */
+    printf("\nbits that follow the reading (|r| >= %.1f)\n", ANALYSE_R);
+    for (i = 0; i < 24; i++)
+    {
+        for (j = 0; j < nmodes; j++)
+        {
+            m = &modes[j];
+            if ((m->set_values[i] == 0) || (m->set_values[i] == m->values))
+                continue;
+
+            mean = m->sum / m->values;
+            sd = sqrt(m->sumsq / m->values - mean * mean);
+            if (!(sd > 0))
+                continue;
+
+            mean1 = m->set_sum[i] / m->set_values[i];
+            mean0 = (m->sum - m->set_sum[i]) / (m->values - m->set_values[i]);
+            p = (double)m->set_values[i] / m->values;
+            r = (mean1 - mean0) / sd * sqrt(p * (1 - p));
+            if (fabs(r) < ANALYSE_R)
+                continue;
+
+            analysis_label(label, i);
+            analysis_mode_name(name, sizeof(name), m->mode);
+            printf("%-3s %-16s in %-20s r %6.3f, mean %g set, %g clear\n",
+                label, attribute_table[i], name, r, mean1, mean0);
+        }
+    }
+
+    free(modes);
+}
+
+int
+analyse_main(int argc, char** argv)
+{
+    struct analysis *threads;
+    struct analysis total;
+    struct timespec start;
+    struct timespec end;
+    long records = 0;
+    int nthreads;
+    int c;
+    int k;
+    int n;
+
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((c = getopt(argc, argv, "j:")) != -1)
+    {
+        switch (c)
+        {
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        default:
+            nthreads = 0;
+        }
+    }
+
+    if ((nthreads < 1) || (optind >= argc))
+    {
+        printf("Usage: serial-meter attributes [-j threads] capture ...\n");
+        return 1;
+    }
+
+    analyse.ncaptures = argc - optind;
+    analyse.captures = calloc(analyse.ncaptures, sizeof(struct capture *));
+    for (n = 0; n < analyse.ncaptures; n++)
+    {
+        analyse.captures[n] = capture_open(argv[optind + n]);
+        if (analyse.captures[n] == NULL)
+            return 1;
+        records += analyse.captures[n]->nrecords;
+        analyse.nchunks += (analyse.captures[n]->nrecords + ANALYSE_CHUNK - 1) /
+            ANALYSE_CHUNK;
+    }
+
+    /* The threads read the chunks in any order. */
+    for (n = 0; n < analyse.ncaptures; n++)
+        madvise(analyse.captures[n]->header, (char *)(analyse.captures[n]->
+            records + analyse.captures[n]->nrecords) -
+            (char *)analyse.captures[n]->header, MADV_WILLNEED);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    threads = calloc(nthreads, sizeof(struct analysis));
+    for (n = 0; n < nthreads; n++)
+    {
+        if (pthread_create(&threads[n].thread, NULL, analysis_thread,
+            &threads[n]) != 0)
+        {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    memset(&total, 0, sizeof(total));
+    for (n = 0; n < nthreads; n++)
+    {
+        pthread_join(threads[n].thread, NULL);
+        for (k = 0; k < threads[n].size; k++)
+        {
+            if (threads[n].table[k].used)
+                analysis_add(&total, &threads[n].table[k]);
+        }
+        total.packets += threads[n].packets;
+        total.failures += threads[n].failures;
+        free(threads[n].table);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    analysis_report(&total, records, (end.tv_sec - start.tv_sec) +
+        (end.tv_nsec - start.tv_nsec) / 1e9);
+
+    return 0;
+}
+
+/*
+ ****************************************************************
+ *
+ * Event loop.
+ *
+ ****************************************************************
+ */
+
+/*
+ * With "-e" all the ports are read by the main thread, rather than a
+ * thread each, so thousands of them cost no more than their sockets.
+ * Each port's session, connecting, framing packets and reconnecting,
+ * is meter_session(), written as sequential code like meter_thread()
+ * but as a stackless coroutine (see CO_BEGIN) that yields whenever it
+ * would block: on its port becoming readable, on a connection
+ * completing, or on a timer for backing off and noticing a server that
+ * has gone quiet.  event_loop() resumes the sessions from epoll.
+ * Device server names are looked up with getaddrinfo_a(), and the
+ * session checks on the lookup every RESOLVE_POLL ms, so a slow DNS
+ * server holds up only the ports waiting on it.
+ */
+#define EVENT_BATCH	64	/* Events taken from epoll at a time. */
+#define RESOLVE_POLL	10	/* ms between checks on a name lookup. */
+
+/* What meter_session() yields to wait for, besides EPOLLIN/EPOLLOUT. */
+#define SESSION_SLEEP	0	/* Just the timer. */
+#define SESSION_DONE	-1	/* End of a local port. */
+
+/*
+ * Close a session's port.  epoll forgets it, even if the fd number
+ * comes back for the next connection.
+ */
+void
+meter_close(struct meter* m)
+{
+    close(m->fd);
+    m->fd = -1;
+    m->polled_fd = -1;
+}
+
+/*
+ * Handle a packet read from a meter at the given times: capture it,
+ * decode it and pass the sample on.
+ */
+void
+meter_record(struct meter* m, unsigned char* buf, long long time,
+    long long monotime)
+{
+    struct sample sample;
+    long long start;
+    int n;
+
+    if (capture_fd >= 0)
+    {
+        start = trace_begin();
+        capture_write(m, buf, time, monotime);
+        trace_end("capture", start, m->frames);
+    }
+
+    start = trace_begin();
+    n = meter_decode(m, buf, time, monotime, &sample);
+    trace_end("decode", start, m->frames);
+    if (n)
+        return;
+
+    start = trace_begin();
+    if (merge.delay)
+        merge_push(&sample);
+    else
+        emit_sample(&sample);
+    trace_end("output", start, m->frames);
+}
+
+int worker_push(struct meter* m, unsigned char* buf, long long time,
+    long long monotime);
+
+/*
+ * Handle a packet just read from a meter, or in a worker process
+ * hand it to the supervisor.
+ */
+void
+meter_packet(struct meter* m, unsigned char* buf)
+{
+    struct timespec now;
+    struct timespec mono;
+    long long time;
+    long long monotime;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    time = now.tv_sec * 1000000000LL + now.tv_nsec;
+    monotime = mono.tv_sec * 1000000000LL + mono.tv_nsec;
+
+    if (worker_push(m, buf, time, monotime) == 0)
+        meter_record(m, buf, time, monotime);
+}
+
+long long
+event_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+int
+meter_session(struct meter* m)
+{
+    struct gaicb *lookup;
+    socklen_t len;
+    int err;
+    int on = 1;
+    int n;
+
+    CO_BEGIN(m->session_line);
+
+    for (;;)
+    {
+        /* Connect to a device server, backing off while it won't. */
+        while (m->fd < 0)
+        {
+            if (m->addrs == NULL)
+            {
+                memset(&m->hints, 0, sizeof(m->hints));
+                m->hints.ai_family = AF_UNSPEC;
+                m->hints.ai_socktype = SOCK_STREAM;
+                memset(&m->resolve, 0, sizeof(m->resolve));
+                m->resolve.ar_name = m->host;
+                m->resolve.ar_service = m->service;
+                m->resolve.ar_request = &m->hints;
+                lookup = &m->resolve;
+
+                err = getaddrinfo_a(GAI_NOWAIT, &lookup, 1, NULL);
+                if (err == 0)
+                {
+                    while (gai_error(&m->resolve) == EAI_INPROGRESS)
+                    {
+                        m->wake = event_now() + RESOLVE_POLL * 1000000LL;
+                        CO_YIELD(m->session_line, SESSION_SLEEP);
+                    }
+                    err = gai_error(&m->resolve);
+                }
+
+                if (err)
+                    printf("%s:%s: %s\n", m->host, m->service,
+                        gai_strerror(err));
+                else
+                    m->addrs = m->resolve.ar_result;
+            }
+
+            for (m->addr = m->addrs; m->addr && (m->fd < 0);
+                m->addr = m->addr->ai_next)
+            {
+                m->fd = socket(m->addr->ai_family, m->addr->ai_socktype,
+                    m->addr->ai_protocol);
+                if (m->fd < 0)
+                    continue;
+
+                fcntl(m->fd, F_SETFL, fcntl(m->fd, F_GETFL) | O_NONBLOCK);
+
+                err = 0;
+                if (connect(m->fd, m->addr->ai_addr, m->addr->ai_addrlen) < 0)
+                {
+                    if (errno != EINPROGRESS)
+                        err = errno;
+                    else
+                    {
+                        m->wake = event_now() + CONNECT_TIMEOUT * 1000000LL;
+                        CO_YIELD(m->session_line, EPOLLOUT);
+
+                        err = ETIMEDOUT;
+                        if (!m->timed_out)
+                        {
+                            len = sizeof(err);
+                            getsockopt(m->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                        }
+                    }
+                }
+
+                if (err)
+                    meter_close(m);
+            }
+
+            if (m->fd < 0)
+            {
+                /* Look the name up again, it may have moved. */
+                if (m->addrs)
+                    freeaddrinfo(m->addrs);
+                m->addrs = NULL;
+
+                printf("%s: couldn't connect, retrying in %d ms\n",
+                    m->port, m->backoff);
+                m->wake = event_now() + m->backoff * 1000000LL;
+                m->backoff = (m->backoff * 2 > BACKOFF_MAX) ? BACKOFF_MAX :
+                    m->backoff * 2;
+                CO_YIELD(m->session_line, SESSION_SLEEP);
+                continue;
+            }
+
+            setsockopt(m->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            setsockopt(m->fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+
+            m->telnet_state = TS_DATA;
+            m->rpos = 0;
+            m->rlen = 0;
+            m->read_time = 0;
+            m->skip = 0;
+            if (m->source == SOURCE_RFC2217)
+                rfc2217_negotiate(m);
+        }
+
+        /* Read packets until the port ends or the connection is lost. */
+        while (m->fd >= 0)
+        {
+            n = frame_packet(m, 0);
+
+            if (n == FRAME_MORE)
+            {
+                if (m->source != SOURCE_TTY)
+                    m->wake = event_now() + TCP_IDLE_TIMEOUT * 1000000000LL;
+                CO_YIELD(m->session_line, EPOLLIN);
+
+                if (m->timed_out)
+                {
+                    printf("%s: connection lost\n", m->port);
+                    m->reconnects++;
+                    meter_close(m);
+                    m->frame_line = 0;
+                    m->resyncs++;
+                }
+                continue;
+            }
+
+            if (n == -2)
+                CO_RETURN(m->session_line, SESSION_DONE);
+
+            if (n)
+            {
+                m->resyncs++;
+                continue;
+            }
+
+            m->frames++;
+            meter_packet(m, m->frame);
+        }
+
+        /* Wait a while before reconnecting. */
+        m->wake = event_now() + m->backoff * 1000000LL;
+        m->backoff = (m->backoff * 2 > BACKOFF_MAX) ? BACKOFF_MAX :
+            m->backoff * 2;
+        CO_YIELD(m->session_line, SESSION_SLEEP);
+    }
+
+    CO_END(m->session_line);
+
+    return SESSION_DONE;
+}
+
+struct
+{
+    int fd;			/* epoll */
+    long long timer;		/* The earliest wake of any session. */
+    int live;			/* Sessions not done. */
+} event;
+
+/*
+ * Run a session until it next has to wait, and wait for what it asks.
+ */
+void
+event_resume(struct meter* m, int timed_out)
+{
+    struct epoll_event ev;
+    int wait;
+
+    m->timed_out = timed_out;
+    m->wake = 0;
+    wait = meter_session(m);
+
+    if (wait == SESSION_DONE)
+    {
+        meter_close(m);
+        event.live--;
+        return;
+    }
+
+    if (m->wake && (m->wake < event.timer))
+        event.timer = m->wake;
+
+    if ((m->fd < 0) ||
+        ((m->fd == m->polled_fd) && (wait == m->polled_events)))
+        return;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = wait;
+    ev.data.ptr = m;
+    if (epoll_ctl(event.fd, (m->fd == m->polled_fd) ? EPOLL_CTL_MOD :
+        EPOLL_CTL_ADD, m->fd, &ev) < 0)
+        perror(m->port);
+
+    m->polled_fd = m->fd;
+    m->polled_events = wait;
+}
+
+/*
+ * Read the first n meters, but for those another process reads, until
+ * all their ports have ended.
+ */
+void
+event_loop(int n)
+{
+    struct epoll_event events[EVENT_BATCH];
+    long long now;
+    int timeout;
+    int ready;
+    int i;
+
+    trace_thread("events");
+
+    event.fd = epoll_create1(0);
+    if (event.fd < 0)
+    {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    event.timer = LLONG_MAX;
+    event.live = 0;
+    for (i = 0; i < n; i++)
+    {
+        if (meters[i].remote)
+            continue;
+        event.live++;
+        meters[i].polled_fd = -1;
+        meters[i].vmin = 0;	/* See wait_for_bursts(). */
+        if (meters[i].fd >= 0)
+            fcntl(meters[i].fd, F_SETFL,
+                fcntl(meters[i].fd, F_GETFL) | O_NONBLOCK);
+        event_resume(&meters[i], 0);
+    }
+
+    while (event.live > 0)
+    {
+        timeout = -1;
+        if (event.timer != LLONG_MAX)
+        {
+            now = event_now();
+            timeout = (event.timer > now) ?
+                (event.timer - now + 999999) / 1000000 : 0;
+        }
+
+        ready = epoll_wait(event.fd, events, EVENT_BATCH, timeout);
+        for (i = 0; i < ready; i++)
+            event_resume(events[i].data.ptr, 0);
+
+        /* Wake the sessions whose time has come, and find the next. */
+        now = event_now();
+        if (now >= event.timer)
+        {
+            event.timer = LLONG_MAX;
+            for (i = 0; i < n; i++)
+            {
+                if (meters[i].wake && (meters[i].wake <= now))
+                    event_resume(&meters[i], 1);
+                else if (meters[i].wake && (meters[i].wake < event.timer))
+                    event.timer = meters[i].wake;
+            }
+        }
+    }
+
+    close(event.fd);
+}
+
+/*
+ ****************************************************************
+ *
+ * Workers.
+ *
+ ****************************************************************
+ */
+
+/*
+ * "-P n" reads the ports in n worker processes rather than threads of
+ * this one, so that a port that crashes or wedges its reader (a bad
+ * USB serial driver, say) can only take the meters of one worker with
+ * it.  Ports are dealt out to the workers in turn.  Each worker reads
+ * and frames packets as usual, with a thread per port or with -e, and
+ * puts them with the times they arrived in a ring in shared memory.
+ * This process, the supervisor, takes the packets from all the rings
+ * and does everything else, decoding, captures and outputs, so none of
+ * the meters' state is lost when a worker has to be restarted.
+ *
+ * A worker writes a byte to its pipe when it puts a packet in an
+ * empty ring.  The supervisor sleeps in poll() on the pipes, and sees
+ * a worker die as its pipe hanging up.
+ *
+ * The workers aren't forked by the supervisor, which has threads by
+ * then: a child only gets the thread that forked it, and any lock
+ * another thread held (stdout, malloc's, the resolver's) stays held
+ * for good.  Instead a fork server is forked before any thread is
+ * started, and forks the workers, and reaps them, when the supervisor
+ * asks over a socket.  It passes back each worker's pipe.
+ */
+#define WORKER_RING	1024	/* Packets, a power of two. */
+#define WORKER_RESTART	100	/* ms before restarting a worker. */
+
+/* Requests to the fork server. */
+#define WORKER_START	1	/* Fork worker w, and pass back its pipe. */
+#define WORKER_WAIT	2	/* Reap worker w. */
+
+struct worker_message
+{
+    int op;
+    int w;
+    int status;			/* In the reply, -1 if it failed, or */
+};				/* as waitpid() has it. */
+
+struct worker_record
+{
+    int meter;
+    long long time;
+    long long monotime;
+    unsigned long frames;	/* The meter's counters, as the worker */
+    unsigned long resyncs;	/* has them. */
+    unsigned long invalid_bytes;
+    unsigned long reconnects;
+    unsigned char packet[15];
+};
+
+/* A worker's packets, in memory shared with the supervisor. */
+struct worker_ring
+{
+    _Atomic unsigned long head;	/* Written by the worker, */
+    _Atomic unsigned long tail;	/* and by the supervisor. */
+    _Atomic unsigned long dropped;	/* Packets that didn't fit. */
+    struct worker_record records[WORKER_RING];
+};
+
+struct
+{
+    int n;
+    int self;			/* This worker, or -1 if not one. */
+    int nports;
+    int events;			/* Workers read with event_loop(). */
+    pid_t supervisor;
+    int server;			/* Socket to the fork server, or -1. */
+    struct worker_ring *rings;
+    pid_t *pids;		/* Kept by the fork server. */
+    int *pipes;			/* The supervisor's ends, or -1. */
+    long long *restart;		/* When to start a worker again, or 0. */
+    int wake;			/* A worker's end of its pipe. */
+    pthread_mutex_t lock;	/* Between a worker's threads. */
+} workers = { 0, -1, 0, 0, 0, -1, NULL, NULL, NULL, NULL, -1,
+    PTHREAD_MUTEX_INITIALIZER };
+
+void* meter_thread(void* arg);
+
+/*
+ * Hand a packet to the supervisor.  Returns 0 if this process isn't a
+ * worker, and should handle it itself.
+ */
+int
+worker_push(struct meter* m, unsigned char* buf, long long time,
+    long long monotime)
+{
+    struct worker_ring *r;
+    struct worker_record *rec;
+    unsigned long head;
+
+    if (workers.self < 0)
+        return 0;
+
+    r = &workers.rings[workers.self];
+
+    pthread_mutex_lock(&workers.lock);
+    head = r->head;
+    if (head - r->tail >= WORKER_RING)
+        r->dropped++;
+    else
+    {
+        rec = &r->records[head % WORKER_RING];
+        rec->meter = m->index;
+        rec->time = time;
+        rec->monotime = monotime;
+        rec->frames = m->frames;
+        rec->resyncs = m->resyncs;
+        rec->invalid_bytes = m->invalid_bytes;
+        rec->reconnects = m->reconnects;
+        memcpy(rec->packet, buf, sizeof(rec->packet));
+        r->head = head + 1;
+
+        /* The supervisor may have emptied the ring and gone to sleep. */
+        if ((r->tail == head) && (write(workers.wake, "", 1) < 0) &&
+            (errno != EAGAIN))
+            perror("worker");
+    }
+    pthread_mutex_unlock(&workers.lock);
+
+    return 1;
+}
+
+/*
+ * Take the packets a worker has put in its ring.  The ring is checked,
+ * as a worker that crashed may have scribbled on it.
+ */
+void
+worker_drain(int w)
+{
+    struct worker_ring *r = &workers.rings[w];
+    struct worker_record *rec;
+    struct meter *m;
+    unsigned long tail = r->tail;
+    unsigned long head;
+
+    /*
+     * Look at the head again after storing the last tail: a packet put
+     * in meanwhile found the ring not empty, so there was no wake up.
+     */
+    while ((head = r->head) != tail)
+    {
+        if (head - tail > WORKER_RING)
+        {
+            printf("Worker %d: ring corrupted, %lu packets lost\n", w,
+                head - tail);
+            r->tail = head;
+            return;
+        }
+
+        for (; tail != head; tail++)
+        {
+            rec = &r->records[tail % WORKER_RING];
+            if ((rec->meter >= 0) && (rec->meter < workers.nports) &&
+                (rec->meter % workers.n == w))
+            {
+                m = &meters[rec->meter];
+                m->frames = rec->frames;
+                m->resyncs = rec->resyncs;
+                m->invalid_bytes = rec->invalid_bytes;
+                m->reconnects = rec->reconnects;
+                meter_record(m, rec->packet, rec->time, rec->monotime);
+            }
+            r->tail = tail + 1;
+        }
+    }
+}
+
+/*
+ * Read worker w's ports until they all end, in a process forked by
+ * the fork server, whose pid is parent.  wake is the worker's end of
+ * its pipe.
+ */
+void
+worker_main(int w, int wake, pid_t parent)
+{
+    int n;
+
+    /* Go when the fork server does. */
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() != parent)
+        _exit(1);
+
+    fcntl(wake, F_SETFL, O_NONBLOCK);
+    workers.wake = wake;
+    workers.self = w;
+
+    for (n = 0; n < workers.nports; n++)
+        meters[n].remote = (n % workers.n != w);
+
+    if (workers.events)
+        event_loop(workers.nports);
+    else
+    {
+        for (n = 0; n < workers.nports; n++)
+        {
+            if (meters[n].remote == 0)
+                pthread_create(&meters[n].thread, NULL, meter_thread,
+                    &meters[n]);
+        }
+        for (n = 0; n < workers.nports; n++)
+        {
+            if (meters[n].remote == 0)
+                pthread_join(meters[n].thread, NULL);
+        }
+    }
+
+    fflush(stdout);
+    _exit(0);
+}
+
+/*
+ * Send a fork server reply, with a pipe if fd isn't -1.
+ */
+void
+worker_reply(int sock, struct worker_message* msg, int fd)
+{
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { msg, sizeof(*msg) };
+    struct msghdr mh;
+    struct cmsghdr *cm;
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+
+    if (fd >= 0)
+    {
+        memset(&control, 0, sizeof(control));
+        mh.msg_control = control.buf;
+        mh.msg_controllen = sizeof(control.buf);
+        cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+    }
+
+    if (sendmsg(sock, &mh, MSG_NOSIGNAL) < 0)
+        perror("fork server");
+}
+
+/*
+ * The fork server: start and reap workers for the supervisor until it
+ * hangs up.  It has only the one thread, so the workers start clean.
+ */
+void
+worker_server(int sock)
+{
+    struct worker_message msg;
+    pid_t self = getpid();
+    int fds[2];
+    int fd;
+
+    /* Go when the supervisor does, and the workers with us. */
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() != workers.supervisor)
+        _exit(1);
+
+    while (recv(sock, &msg, sizeof(msg), 0) == sizeof(msg))
+    {
+        fd = -1;
+        msg.status = 0;
+
+        if ((msg.w < 0) || (msg.w >= workers.n))
+            msg.status = -1;
+        else if (msg.op == WORKER_WAIT)
+            waitpid(workers.pids[msg.w], &msg.status, 0);
+        else if (pipe(fds) < 0)
+        {
+            perror("pipe");
+            msg.status = -1;
+        }
+        else
+        {
+            workers.pids[msg.w] = fork();
+            if (workers.pids[msg.w] == 0)
+            {
+                close(sock);
+                close(fds[0]);
+                worker_main(msg.w, fds[1], self);
+            }
+
+            close(fds[1]);
+            if (workers.pids[msg.w] < 0)
+            {
+                perror("fork");
+                close(fds[0]);
+                msg.status = -1;
+            }
+            else
+                fd = fds[0];
+        }
+
+        worker_reply(sock, &msg, fd);
+        if (fd >= 0)
+            close(fd);
+    }
+
+    _exit(0);
+}
+
+/*
+ * Ask the fork server to do op for worker w, and get back the status
+ * and, if fd isn't NULL, the pipe it passed.  Returns -1 if the fork
+ * server has gone.
+ */
+int
+worker_ask(int op, int w, int* status, int* fd)
+{
+    struct worker_message msg = { op, w, 0 };
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { &msg, sizeof(msg) };
+    struct msghdr mh;
+    struct cmsghdr *cm;
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+
+    if ((workers.server < 0) ||
+        (send(workers.server, &msg, sizeof(msg), MSG_NOSIGNAL) < 0) ||
+        (recvmsg(workers.server, &mh, 0) != sizeof(msg)))
+    {
+        printf("Fork server gone, workers can't be restarted\n");
+        if (workers.server >= 0)
+            close(workers.server);
+        workers.server = -1;
+        return -1;
+    }
+
+    *status = msg.status;
+
+    cm = CMSG_FIRSTHDR(&mh);
+    if (fd)
+        *fd = -1;
+    if (fd && cm && (cm->cmsg_level == SOL_SOCKET) &&
+        (cm->cmsg_type == SCM_RIGHTS))
+        memcpy(fd, CMSG_DATA(cm), sizeof(int));
+
+    return 0;
+}
+
+/*
+ * Have worker w started.  Returns -1 if it couldn't be.
+ */
+int
+worker_start(int w)
+{
+    int status;
+    int fd;
+
+    if (worker_ask(WORKER_START, w, &status, &fd) < 0)
+        return -1;
+    if ((status < 0) || (fd < 0))
+        return -1;
+
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    workers.pipes[w] = fd;
+
+    return 0;
+}
+
+/*
+ * A worker's pipe hung up: restart it, unless its ports all ended.
+ * Returns 1 if it has finished for good.
+ */
+int
+worker_ended(int w)
+{
+    int status;
+
+    close(workers.pipes[w]);
+    workers.pipes[w] = -1;
+
+    /* Anything it managed to send before it went. */
+    worker_drain(w);
+
+    if (worker_ask(WORKER_WAIT, w, &status, NULL) < 0)
+        return 1;
+
+    if (WIFEXITED(status) && (WEXITSTATUS(status) == 0))
+        return 1;
+
+    if (WIFSIGNALED(status))
+        printf("Worker %d killed by signal %d, restarting\n", w,
+            WTERMSIG(status));
+    else
+        printf("Worker %d exited with %d, restarting\n", w,
+            WEXITSTATUS(status));
+    workers.restart[w] = event_now() + WORKER_RESTART * 1000000LL;
+
+    return 0;
+}
+
+/*
+ * Set up to read the first nports meters in n worker processes, and
+ * fork the fork server.  This has to be done before any other thread
+ * is started.
+ */
+int
+workers_prepare(int n, int nports, int events)
+{
+    int fds[2];
+    pid_t pid;
+    int w;
+
+    if (n > nports)
+        n = nports;
+
+    workers.n = n;
+    workers.nports = nports;
+    workers.events = events;
+    workers.supervisor = getpid();
+    workers.rings = mmap(NULL, n * sizeof(struct worker_ring),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (workers.rings == MAP_FAILED)
+    {
+        perror("mmap");
+        return -1;
+    }
+    workers.pids = calloc(n, sizeof(pid_t));
+    workers.pipes = calloc(n, sizeof(int));
+    workers.restart = calloc(n, sizeof(long long));
+    for (w = 0; w < n; w++)
+        workers.pipes[w] = -1;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) < 0)
+    {
+        perror("socketpair");
+        return -1;
+    }
+
+    /* Or the workers would print what is still buffered again. */
+    fflush(stdout);
+
+    pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        return -1;
+    }
+
+    if (pid == 0)
+    {
+        close(fds[0]);
+        worker_server(fds[1]);
+    }
+
+    close(fds[1]);
+    workers.server = fds[0];
+
+    return 0;
+}
+
+/*
+ * Read the meters in the workers until all their ports have ended.
+ */
+int
+workers_run(void)
+{
+    struct pollfd *pfds;
+    char buf[64];
+    long long now;
+    int timeout;
+    int live;
+    int len;
+    int n = workers.n;
+    int w;
+
+    pfds = calloc(n, sizeof(struct pollfd));
+
+    for (w = 0; w < n; w++)
+    {
+        if (worker_start(w) < 0)
+            return -1;
+    }
+
+    live = n;
+    while (live > 0)
+    {
+        timeout = -1;
+        now = event_now();
+        for (w = 0; w < n; w++)
+        {
+            if (workers.restart[w] && (workers.restart[w] <= now))
+            {
+                workers.restart[w] = 0;
+                if (worker_start(w) < 0)
+                {
+                    /* Without the fork server it can't be started again. */
+                    if (workers.server < 0)
+                        live--;
+                    else
+                        workers.restart[w] = now + WORKER_RESTART * 1000000LL;
+                }
+            }
+            if (workers.restart[w] && ((timeout < 0) ||
+                (workers.restart[w] - now) / 1000000 + 1 < timeout))
+                timeout = (workers.restart[w] - now) / 1000000 + 1;
+
+            pfds[w].fd = workers.pipes[w];
+            pfds[w].events = POLLIN;
+            pfds[w].revents = 0;
+        }
+
+        if ((poll(pfds, n, timeout) < 0) && (errno != EINTR))
+        {
+            perror("poll");
+            return -1;
+        }
+
+        for (w = 0; w < n; w++)
+        {
+            if ((pfds[w].fd < 0) || (pfds[w].revents == 0))
+                continue;
+
+            while ((len = read(pfds[w].fd, buf, sizeof(buf))) > 0)
+                ;
+            worker_drain(w);
+
+            if ((len == 0) && worker_ended(w))
+                live--;
+        }
+    }
+
+    for (w = 0; w < n; w++)
+    {
+        if (workers.rings[w].dropped)
+            printf("Worker %d: %lu packets dropped, supervisor too slow\n",
+                w, (unsigned long)workers.rings[w].dropped);
+    }
+
+    return 0;
+}
+
+/*
+ ****************************************************************
+ *
+ * Main loop.
+ *
+ ****************************************************************
+ */
+
+/*
+ * Report a change in a meter's readings, to stdout even with -q, and
+ * to the other outputs.
+ */
+void
+emit_event(struct sample* e)
+{
+    struct config *c = config_read();
+
+    flockfile(stdout);
+    if (nmeters > 1)
+        printf("%s: ", e->meter->name);
+    printf("%s from %.6g to %.6g %s after %.3f s, z %.1f\n",
+        event_names[e->event], e->baseline, e->value,
+        meter_unit(e->meter, e->attributes), e->latency / 1e9, e->score);
+    funlockfile(stdout);
+
+    if (c->broker)
+        mqtt_queue(e);
+
+    if (c->influx)
+        influx_queue(e);
+
+    if (http.listen)
+        sse_queue(e);
+
+    config_done();
+}
+
+/*
+ * Pass a sample on to each of the outputs.
+ */
+void
+emit_sample(struct sample* s)
+{
+    struct config *c = config_read();
+    struct sample event;
+    int n;
+
+    meter_store_latest(s->meter, s);
+
+    if (!c->quiet)
+    {
+        flockfile(stdout);
+        if (nmeters > 1)
+            printf("%s: ", s->meter->name);
+        printf("%s ", s->display);
+        if (s->meter->unit)
+            printf("%s ", s->meter->unit);
+        print_attributes(s->attributes);
+        if (s->filtered)
+        {
+            printf("median %.6g ", s->median);
+            for (n = 0; n < filter.npercentiles; n++)
+                printf("p%g %.6g ", filter.percentiles[n], s->percentiles[n]);
+        }
+        printf("\n");
+        funlockfile(stdout);
+    }
+
+    if (c->broker)
+        mqtt_queue(s);
+
+    if (c->influx)
+        influx_queue(s);
+
+    if (http.listen)
+        sse_queue(s);
+
+    if (history_dir)
+        history_append(s);
+
+    if (c->detect.z && detect_update(s, &c->detect, &event))
+        emit_event(&event);
+
+    for (n = 0; n < s->meter->ndependents; n++)
+        derived_update(s->meter->dependents[n], s);
+
+    config_done();
+}
+
+/*
+ * Each meter has a thread that reads and decodes its packets.
+ */
+void*
+meter_thread(void* arg)
+{
+    struct meter *m = arg;
+    unsigned char buf[15];
+    long long start;
+    int n;
+
+    trace_thread(m->name);
+
+    if (m->source != SOURCE_TTY)
+        meter_connect(m);
+
+    while (1)
+    {
+        /* Read a packet. */
+        start = trace_begin();
+        n = read_packet(m, buf);
+        trace_end("frame", start, m->frames);
+
+        if (n == -2)
+            break;
+
+        /* Ignore errors. */
+        if (n)
+        {
+            m->resyncs++;
+            continue;
+        }
+        m->frames++;
+
+        meter_packet(m, buf);
+    }
+
+    return NULL;
+}
+
+void
+usage(void)
+{
+    printf("Usage: serial-meter [options] [[name=]port ...]\n"
+        "  -q                    don't print samples\n"
+        "  -m broker[:port]      publish samples over MQTT\n"
+        "  -t prefix             MQTT topic prefix\n"
+        "  -i file|unix://path   write InfluxDB line protocol\n"
+        "  -H [addr:]port        serve /metrics and /events over HTTP\n"
+        "  -d name[:unit][@ms]=expression\n"
+        "                        compute a channel from other meters\n"
+        "  -I name[:unit][@ms]=expression\n"
+        "                        integrate a channel over time\n"
+        "  -C file               checkpoint integrator totals\n"
+        "  -w file               capture packets to a file\n"
+        "  -r file               replay a capture instead of reading ports\n"
+        "  -M ms                 merge meters into time order\n"
+        "  -g ms                 resample onto a time grid\n"
+        "  -D z[:h]              report spikes of z deviations and steps\n"
+        "  -T file               trace each stage, written on SIGUSR1\n"
+        "  -x dir                keep each meter's history as NumPy files\n"
+        "  -f file               load segment and attribute maps\n"
+        "  -F n[:p,...]          add the median and percentiles of n readings\n"
+        "  -c file               correct readings from calibration tables\n"
+        "  -e                    read all the ports from one event loop\n"
+        "  -P n                  read the ports in n worker processes\n"
+        "  -k file               settings, reloaded when the file changes\n"
+        "  -G ms                 a silence this long ends a packet\n"
+        "\n"
+        "       serial-meter xcorr [-s ms] [-l seconds] a b capture ...\n"
+        "                        find the lag between two meters\n"
+        "       serial-meter bench [-n frames] [-o file] [-c file] "
+        "[capture ...]\n"
+        "                        time each stage of decoding\n"
+        "       serial-meter latency [-p ports,...] [-n frames] [-r rate] "
+        "[-l us] [-- options]\n"
+        "                        measure latency through pty pairs\n"
+        "       serial-meter attributes [-j threads] capture ...\n"
+        "                        analyse the attribute bits\n"
+        "       serial-meter downsample [-n points] [-m meter] "
+        "capture|dir ...\n"
+        "                        cut series down for plotting\n");
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+  char *serve = NULL;
+  char *port = "/dev/ttyS0";
+  char **derived;
+  int *integrate;
+  int nderived = 0;
+  int nports;
+  int events = 0;
+  int processes = 0;
+  char *capture = NULL;
+  char *history = NULL;
+  struct capture **captures;
+  int ncaptures = 0;
+  sigset_t signals;
+  pthread_t checkpointer;
+  pthread_t tracer;
+  int c;
+  int n;
+
+  build_tables();
+
+  if ((argc > 1) && (strcmp(argv[1], "xcorr") == 0))
+      return xcorr_main(argc - 1, argv + 1);
+  if ((argc > 1) && (strcmp(argv[1], "bench") == 0))
+      return bench_main(argc - 1, argv + 1);
+  if ((argc > 1) && (strcmp(argv[1], "latency") == 0))
+      return latency_main(argc - 1, argv + 1);
+  if ((argc > 1) && (strcmp(argv[1], "attributes") == 0))
+      return analyse_main(argc - 1, argv + 1);
+  if ((argc > 1) && (strcmp(argv[1], "downsample") == 0))
+      return downsample_main(argc - 1, argv + 1);
+
+  derived = calloc(argc, sizeof(char *));
+  integrate = calloc(argc, sizeof(int));
+  captures = calloc(argc, sizeof(struct capture *));
+
+  while ((c = getopt(argc, argv,
+      "hqem:t:i:H:d:I:C:w:r:M:g:D:T:x:f:F:c:P:k:G:")) != -1)
+  {
+      switch (c)
+      {
+      case 'q':
+          config.defaults.quiet = 1;
+          break;
+      case 'e':
+          events = 1;
+          break;
+      case 'k':
+          config.file = optarg;
+          break;
+      case 'G':
+          frame_gap = atol(optarg) * 1000000LL;
+          if (frame_gap <= 0)
+              usage();
+          break;
+      case 'P':
+          processes = atoi(optarg);
+          if (processes < 1)
+              usage();
+          break;
+      case 'm':
+          config.defaults.broker = optarg;
+          break;
+      case 't':
+          mqtt.prefix = optarg;
+          break;
+      case 'i':
+          config.defaults.influx = optarg;
+          break;
+      case 'H':
+          serve = optarg;
+          break;
+      case 'd':
+          derived[nderived++] = optarg;
+          break;
+      case 'I':
+          integrate[nderived] = 1;
+          derived[nderived++] = optarg;
+          break;
+      case 'C':
+          checkpoint_file = optarg;
+          break;
+      case 'w':
+          capture = optarg;
+          break;
+      case 'r':
+          captures[ncaptures] = capture_open(optarg);
+          if (captures[ncaptures++] == NULL)
+              exit(1);
+          break;
+      case 'M':
+          merge.delay = atol(optarg) * 1000000LL;
+          break;
+      case 'g':
+          merge.grid = atol(optarg) * 1000000LL;
+          break;
+      case 'T':
+          trace.file = optarg;
+          break;
+      case 'x':
+          history = optarg;
+          break;
+      case 'f':
+          if (load_variant(optarg) < 0)
+              exit(1);
+          break;
+      case 'F':
+          if (filter_parse(optarg) < 0)
+              usage();
+          break;
+      case 'c':
+          if (calibrate_load(optarg) < 0)
+              exit(1);
+          break;
+      case 'D':
+          if (config_detect(optarg, &config.defaults.detect) < 0)
+              usage();
+          break;
+      default:
+          usage();
+      }
+  }
+
+  if (ncaptures)
+  {
+      if (optind < argc)
+          usage();
+
+      /* The meters come from the captures rather than ports. */
+      nports = 0;
+      for (n = 0; n < ncaptures; n++)
+          nports += captures[n]->header->nmeters;
+      nmeters = nports + nderived;
+      meters = calloc(nmeters, sizeof(struct meter));
+
+      nports = 0;
+      for (n = 0; n < ncaptures; n++)
+      {
+          capture_meters(captures[n], nports, n + 1);
+          nports += captures[n]->header->nmeters;
+      }
+  }
+  else
+  {
+      nports = argc - optind;
+      if (nports == 0)
+          nports = 1;
+      nmeters = nports + nderived;
+      meters = calloc(nmeters, sizeof(struct meter));
+
+      for (n = 0; n < nports; n++)
+      {
+          if (optind + n < argc)
+              port = argv[optind + n];
+
+          if (meter_open(&meters[n], port, n))
+              exit(0);
+      }
+  }
+
+  for (n = 0; n < nderived; n++)
+  {
+      if (derived_open(&meters[nports + n], derived[n], nports + n,
+          integrate[n]))
+          exit(1);
+  }
+
+  calibrate_start();
+
+  /* Before any other threads, see worker_server(). */
+  if (processes && (ncaptures == 0) &&
+      (workers_prepare(processes, nports, events) < 0))
+      exit(1);
+
+  /* Before any other threads, so that they all block SIGUSR1. */
+  if (trace.file)
+  {
+      sigemptyset(&signals);
+      sigaddset(&signals, SIGUSR1);
+      pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+      pthread_create(&tracer, NULL, trace_signal_thread, NULL);
+      trace_thread("main");
+  }
+
+  if (checkpoint_file)
+  {
+      checkpoint_load();
+
+      sigemptyset(&signals);
+      sigaddset(&signals, SIGINT);
+      sigaddset(&signals, SIGTERM);
+      sigaddset(&signals, SIGHUP);
+      pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+      pthread_create(&checkpointer, NULL, checkpoint_thread, &signals);
+  }
+
+  if (config_start())
+      exit(1);
+
+  if (serve && http_start(serve))
+  {
+      printf("Couldn't start HTTP server\n");
+      exit(1);
+  }
+
+  if (capture && capture_create(capture, nports))
+      exit(1);
+
+  if (history && history_start(history))
+      exit(1);
+
+  if (ncaptures)
+  {
+      merge_init(0);
+      replay(captures, ncaptures);
+  }
+  else
+  {
+      /* Resampling needs the meters in order. */
+      if (merge.grid && (merge.delay == 0))
+          merge.delay = MERGE_DELAY * 1000000LL;
+      merge_init(nports);
+
+      if (processes)
+      {
+          if (workers_run() < 0)
+              exit(1);
+      }
+      else if (events)
+          event_loop(nports);
+      else
+      {
+          for (n = 0; n < nports; n++)
+              pthread_create(&meters[n].thread, NULL, meter_thread,
+                  &meters[n]);
+
+          /* Wait for the ports to reach end of file, if they ever do. */
+          for (n = 0; n < nports; n++)
+              pthread_join(meters[n].thread, NULL);
+      }
+
+      if (merge.delay)
+          merge_stop();
   }
 
+  if (mqtt.queue)
+      mqtt_stop();
+
+  if (influx.buf)
+      influx_stop();
+
+  if (checkpoint_file)
+      checkpoint_save();
+
+  if (trace.file)
+      trace_dump();
+
   return 0;
 }
@@ -0,0 +1,306 @@
+/*
+ * Decoding for TekPower TP4000ZC multimeter packets, as a header
+ * that can be included in C (C99 or later) or C++ (C++14 or later)
+ * programs.  See the protocol description at the top of
+ * serial-meter.c.
+ *
+ * Everything is static inline, and in C++ constexpr, so a compiler
+ * can inline decoding into its callers, and decode packets known at
+ * compile time.  In C++ the tables and the example packet from the
+ * protocol description are checked with static_assert whenever this
+ * header is included, unless TP4000ZC_NO_CHECKS is defined.
+ *
+ * Packets are handled as 14 nibbles, the low four bits of each byte
+ * in order of the position in its high four bits, with the first one
+ * zero if the meter didn't send it.
+ */
+#ifndef TP4000ZC_H
+#define TP4000ZC_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+#define TP4000ZC_FN	static constexpr
+#define TP4000ZC_TABLE	static constexpr
+#else
+#define TP4000ZC_FN	static inline
+#define TP4000ZC_TABLE	static const
+#endif
+
+#define TP4000ZC_NIBBLES	14
+
+/* Attribute bits, as in serial-meter.c. */
+#define TP4000ZC_ATTR_AUTO	(1UL << 1)
+#define TP4000ZC_ATTR_DC	(1UL << 2)
+#define TP4000ZC_ATTR_AC	(1UL << 3)
+#define TP4000ZC_ATTR_DIODE	(1UL << 4)
+#define TP4000ZC_ATTR_KILO	(1UL << 5)
+#define TP4000ZC_ATTR_NANO	(1UL << 6)
+#define TP4000ZC_ATTR_MICRO	(1UL << 7)
+#define TP4000ZC_ATTR_BEEP	(1UL << 8)
+#define TP4000ZC_ATTR_MEGA	(1UL << 9)
+#define TP4000ZC_ATTR_PERCENT	(1UL << 10)
+#define TP4000ZC_ATTR_MILI	(1UL << 11)
+#define TP4000ZC_ATTR_HOLD	(1UL << 12)
+#define TP4000ZC_ATTR_REL	(1UL << 13)
+#define TP4000ZC_ATTR_OHMS	(1UL << 14)
+#define TP4000ZC_ATTR_FARAD	(1UL << 15)
+#define TP4000ZC_ATTR_HERTZ	(1UL << 17)
+#define TP4000ZC_ATTR_VOLTS	(1UL << 18)
+#define TP4000ZC_ATTR_AMPS	(1UL << 19)
+#define TP4000ZC_ATTR_DEGC	(1UL << 22)
+
+/* What decoding a digit can give, besides 0-9. */
+#define TP4000ZC_DIGIT_L	10	/* Out of range. */
+#define TP4000ZC_DIGIT_BLANK	11
+#define TP4000ZC_DIGIT_BAD	-1
+
+/*
+ * The LCD segments lit for 0-9, L and blank.  serial-meter.c starts
+ * its own, loadable, table from the same list.
+ */
+#define TP4000ZC_SEGMENT_LIST \
+    0x7D, 0x05, 0x5B, 0x1F, 0x27, 0x3E, 0x7E, 0x15, 0x7F, 0x3F, 0x68, 0x00
+
+TP4000ZC_TABLE uint8_t tp4000zc_segments[12] = { TP4000ZC_SEGMENT_LIST };
+
+/*
+ * The same table inverted, so that a digit is one lookup of its
+ * seven segment bits rather than a search.
+ */
+TP4000ZC_TABLE int8_t tp4000zc_digits[128] =
+{
+    11, -1, -1, -1, -1,  1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1,  7, -1, -1, -1, -1, -1, -1, -1, -1, -1,  3,
+    -1, -1, -1, -1, -1, -1, -1,  4, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  5,  9,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  2, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, 10, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  0,  6,  8
+};
+
+struct tp4000zc_reading
+{
+    int32_t count;		/* The digits shown, ignoring the point. */
+    int decimals;		/* Digits after the decimal point. */
+    int overload;		/* The display shows L. */
+    int valid;			/* 0 if a digit couldn't be decoded, */
+    int bad;			/* and the nibble the first one starts at. */
+    uint32_t attributes;
+    char display[12];		/* As shown, e.g. "-04.71". */
+};
+
+/*
+ * Decode a digit from its two nibbles with a table like
+ * tp4000zc_digits.  Returns 0-9, TP4000ZC_DIGIT_L, TP4000ZC_DIGIT_BLANK
+ * or TP4000ZC_DIGIT_BAD.
+ */
+TP4000ZC_FN int
+tp4000zc_digit_in(const int8_t* digits, uint8_t high, uint8_t low)
+{
+    return digits[((high & 0x7) << 4) | (low & 0xF)];
+}
+
+TP4000ZC_FN int
+tp4000zc_digit(uint8_t high, uint8_t low)
+{
+    return tp4000zc_digit_in(tp4000zc_digits, high, low);
+}
+
+TP4000ZC_FN uint32_t
+tp4000zc_attributes(const uint8_t* nibbles)
+{
+    return (uint32_t)(nibbles[0] & 0xF) | ((uint32_t)(nibbles[9] & 0xF) << 4) |
+        ((uint32_t)(nibbles[10] & 0xF) << 8) |
+        ((uint32_t)(nibbles[11] & 0xF) << 12) |
+        ((uint32_t)(nibbles[12] & 0xF) << 16) |
+        ((uint32_t)(nibbles[13] & 0xF) << 20);
+}
+
+/*
+ * The power of ten of the SI prefix shown.
+ */
+TP4000ZC_FN int
+tp4000zc_prefix(uint32_t attributes)
+{
+    return (attributes & TP4000ZC_ATTR_NANO) ? -9 :
+        (attributes & TP4000ZC_ATTR_MICRO) ? -6 :
+        (attributes & TP4000ZC_ATTR_MILI) ? -3 :
+        (attributes & TP4000ZC_ATTR_KILO) ? 3 :
+        (attributes & TP4000ZC_ATTR_MEGA) ? 6 : 0;
+}
+
+/*
+ * Decode a packet's four digits and attributes, with a digit table
+ * like tp4000zc_digits.
+ */
+TP4000ZC_FN struct tp4000zc_reading
+tp4000zc_decode_in(const uint8_t* nibbles, const int8_t* digits)
+{
+    struct tp4000zc_reading r = { 0, 0, 0, 1, 0, 0, { 0 } };
+    int point = 0;
+    int digit = 0;
+    int len = 0;
+    int n = 0;
+
+    for (n = 1; n < 9; n += 2)
+    {
+        /* The point before this digit, or the sign before the first. */
+        if (nibbles[n] & 0x8)
+        {
+            if (n == 1)
+                r.display[len++] = '-';
+            else
+            {
+                r.display[len++] = '.';
+                point = 1;
+            }
+        }
+
+        digit = tp4000zc_digit_in(digits, nibbles[n], nibbles[n + 1]);
+        if (digit == TP4000ZC_DIGIT_BAD)
+        {
+            if (r.valid)
+                r.bad = n;
+            r.valid = 0;
+        }
+        else if (digit == TP4000ZC_DIGIT_L)
+        {
+            r.display[len++] = 'L';
+            r.overload = 1;
+        }
+        else if (digit == TP4000ZC_DIGIT_BLANK)
+            r.display[len++] = ' ';
+        else
+        {
+            r.display[len++] = '0' + digit;
+            r.count = r.count * 10 + digit;
+            r.decimals += point;
+        }
+    }
+
+    if (nibbles[1] & 0x8)
+        r.count = -r.count;
+
+    r.attributes = tp4000zc_attributes(nibbles);
+
+    return r;
+}
+
+TP4000ZC_FN struct tp4000zc_reading
+tp4000zc_decode(const uint8_t* nibbles)
+{
+    return tp4000zc_decode_in(nibbles, tp4000zc_digits);
+}
+
+/*
+ * Sort the bytes of a packet, as sent, into nibbles.  Returns 0, or
+ * -1 if they aren't a packet.
+ */
+TP4000ZC_FN int
+tp4000zc_frame(const uint8_t* bytes, int len, uint8_t* nibbles)
+{
+    int position = 0;
+    int n = 0;
+
+    if ((len < TP4000ZC_NIBBLES - 1) || (len > TP4000ZC_NIBBLES) ||
+        ((bytes[len - 1] >> 4) != TP4000ZC_NIBBLES))
+        return -1;
+
+    for (n = 0; n < TP4000ZC_NIBBLES; n++)
+        nibbles[n] = 0;
+
+    for (n = 0; n < len; n++)
+    {
+        position = bytes[n] >> 4;
+        if ((position < 1) || (position > TP4000ZC_NIBBLES))
+            return -1;
+        nibbles[position - 1] = bytes[n] & 0xF;
+    }
+
+    return 0;
+}
+
+/*
+ * Decode a packet as sent.  The reading isn't valid if the bytes
+ * aren't a packet.
+ */
+TP4000ZC_FN struct tp4000zc_reading
+tp4000zc_decode_bytes(const uint8_t* bytes, int len)
+{
+    uint8_t nibbles[TP4000ZC_NIBBLES] = { 0 };
+    struct tp4000zc_reading r = { 0, 0, 0, 0, 0, 0, { 0 } };
+
+    if (tp4000zc_frame(bytes, len, nibbles) == 0)
+        r = tp4000zc_decode(nibbles);
+
+    return r;
+}
+
+#if defined(__cplusplus) && !defined(TP4000ZC_NO_CHECKS)
+
+/*
+ * Every seven segment pattern decodes to the digit in the segment
+ * table that has it, or to nothing.
+ */
+TP4000ZC_FN bool
+tp4000zc_check_tables()
+{
+    for (int v = 0; v < 128; v++)
+    {
+        int expect = TP4000ZC_DIGIT_BAD;
+
+        for (int d = 0; d < 12; d++)
+        {
+            if (tp4000zc_segments[d] == v)
+                expect = d;
+        }
+        if (tp4000zc_digit(v >> 4, v & 0xF) != expect)
+            return false;
+    }
+
+    return true;
+}
+
+static_assert(tp4000zc_check_tables(), "digit table doesn't match segments");
+
+TP4000ZC_FN bool
+tp4000zc_same(const char* a, const char* b)
+{
+    while (*a && (*a == *b))
+    {
+        a++;
+        b++;
+    }
+
+    return *a == *b;
+}
+
+/* "04.71 k ohms", from the protocol description. */
+TP4000ZC_TABLE uint8_t tp4000zc_example[13] =
+{
+    0x27, 0x3D, 0x42, 0x57, 0x69, 0x75, 0x80, 0x95, 0xA2, 0xB0, 0xC4,
+    0xD0, 0xE8
+};
+
+static_assert(tp4000zc_decode_bytes(tp4000zc_example, 13).valid,
+    "example packet doesn't decode");
+static_assert(tp4000zc_decode_bytes(tp4000zc_example, 13).count == 471,
+    "example packet isn't 471");
+static_assert(tp4000zc_decode_bytes(tp4000zc_example, 13).decimals == 2,
+    "example packet isn't 4.71");
+static_assert(tp4000zc_same(tp4000zc_decode_bytes(tp4000zc_example,
+    13).display, "04.71"), "example packet doesn't show 04.71");
+static_assert(tp4000zc_decode_bytes(tp4000zc_example, 13).attributes ==
+    (TP4000ZC_ATTR_KILO | TP4000ZC_ATTR_OHMS | (1UL << 23)),
+    "example packet isn't k ohms");
+static_assert(tp4000zc_prefix(tp4000zc_decode_bytes(tp4000zc_example,
+    13).attributes) == 3, "example packet isn't kilo");
+
+#endif
+
+#undef TP4000ZC_FN
+#undef TP4000ZC_TABLE
+
+#endif /* TP4000ZC_H */